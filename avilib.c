@@ -38,6 +38,7 @@ typedef int ssize_t;
 #endif
 
 #include "avilib.h"
+#include "filewriter.h"
 //#include <time.h>
 
 #define INFO_LIST
@@ -99,6 +100,23 @@ static size_t avi_write (int fd, char *buf, size_t len)
 
 #define PAD_EVEN(x) ( ((x)+1) & ~1 )
 
+/* OpenDML: the header gets room for a super index of ODML_SUPER_ENTRIES,
+   one per RIFF chunk of at most ODML_RIFF_LEN bytes */
+
+#define ODML_SUPER_ENTRIES 512
+#define ODML_HEADERBYTES   16384
+#define ODML_RIFF_LEN      (1UL<<30)
+
+#define AVI_INDEX_OF_INDEXES 0x00
+#define AVI_INDEX_OF_CHUNKS  0x01
+
+#define AVI_HEADERBYTES(AVI) ( (AVI)->odml ? ODML_HEADERBYTES : HEADERBYTES )
+
+/* AVI_IDX_PAGE: index entries a writer keeps in memory, full pages
+   go to a temporary file until the index is written */
+
+#define AVI_IDX_PAGE 4096
+
 
 /* Copy n into dst as a 4 byte, little endian number.
    Should also work on big endian machines */
@@ -153,7 +171,19 @@ static int avi_add_chunk(avi_t *AVI, unsigned char *tag, unsigned char *data, in
 
    length = PAD_EVEN(length);
 
-   if( avi_write(AVI->fdes,(char *)c,8) != 8 ||
+   /* A failed buffered write is only seen later, the position
+      can not be restored then */
+
+   if( AVI->writer )
+   {
+      if( fw_write(AVI->writer,c,8) < 0 ||
+          fw_write(AVI->writer,data,length) < 0 )
+      {
+         AVI_errno = AVI_ERR_WRITE;
+         return -1;
+      }
+   }
+   else if( avi_write(AVI->fdes,(char *)c,8) != 8 ||
        avi_write(AVI->fdes,(char *)data,length) != length )
    {
       lseek(AVI->fdes,AVI->pos,SEEK_SET);
@@ -170,11 +200,88 @@ static int avi_add_chunk(avi_t *AVI, unsigned char *tag, unsigned char *data, in
    return 0;
 }
 
+/* Writes other than chunks at the end of the file go around the
+   writer, what it still holds has to be in the file first */
+
+static int avi_sync(avi_t *AVI)
+{
+   if( AVI->writer && fw_flush(AVI->writer) < 0 )
+   {
+      AVI_errno = AVI_ERR_WRITE;
+      return -1;
+   }
+   return 0;
+}
+
+/* Output bytes that are not a chunk of their own at the end of the file */
+
+static int avi_out(avi_t *AVI, unsigned char *data, long length)
+{
+   if( AVI->writer ) return fw_write(AVI->writer,data,length);
+   return avi_write(AVI->fdes,(char *)data,length) == (size_t)length ? 0 : -1;
+}
+
+/* Write a 4 byte number at pos, somewhere before the end of the file */
+
+static int avi_patch(avi_t *AVI, off_t pos, unsigned long n)
+{
+   unsigned char c[4];
+
+   long2str(c,n);
+   if( avi_sync(AVI) ||
+       lseek(AVI->fdes,pos,SEEK_SET)<0 ||
+       avi_write(AVI->fdes,(char *)c,4) != 4 ||
+       lseek(AVI->fdes,AVI->pos,SEEK_SET)<0 )
+   {
+      AVI_errno = AVI_ERR_WRITE;
+      return -1;
+   }
+   return 0;
+}
+
+/* Temporary file for the index of an output file, next to it
+   rather than in a /tmp that may be in memory. -1 if there is none,
+   the index then stays in memory */
+
+static int avi_idx_tmpfile(const char *filename)
+{
+#ifdef WIN32
+   return -1;
+#else
+   char *name;
+   int fd;
+
+   name = (char *) malloc(strlen(filename)+16);
+   if(name == 0) return -1;
+
+   sprintf(name, "%s.idxXXXXXX", filename);
+   fd = mkstemp(name);
+   if(fd >= 0) unlink(name);
+
+   free(name);
+   return fd;
+#endif
+}
+
 static int avi_add_index_entry(avi_t *AVI, unsigned char *tag, long flags, unsigned long pos, unsigned long len)
 {
    void *ptr;
+   long i;
 
-   if(AVI->n_idx>=AVI->max_idx) {
+   /* A full page of a writer goes to the temporary file, the entry
+      that is added next is the last one and always in memory */
+
+   if(AVI->mode==AVI_MODE_WRITE && AVI->idx_fd>=0 && AVI->max_idx>=AVI_IDX_PAGE &&
+      AVI->n_idx-AVI->idx_spilled>=AVI->max_idx) {
+
+     if(avi_write(AVI->idx_fd,(char *)AVI->idx,AVI->max_idx*16) != (size_t)AVI->max_idx*16) {
+       AVI_errno = AVI_ERR_WRITE;
+       return -1;
+     }
+     AVI->idx_spilled += AVI->max_idx;
+   }
+
+   if(AVI->n_idx-AVI->idx_spilled>=AVI->max_idx) {
      ptr = realloc((void *)AVI->idx,(AVI->max_idx+4096)*16);
      
      if(ptr == 0) {
@@ -189,10 +296,11 @@ static int avi_add_index_entry(avi_t *AVI, unsigned char *tag, long flags, unsig
 
    //   fprintf(stderr, "INDEX %s %ld %lu %lu\n", tag, flags, pos, len);
 
-   memcpy(AVI->idx[AVI->n_idx],tag,4);
-   long2str(AVI->idx[AVI->n_idx]+ 4,flags);
-   long2str(AVI->idx[AVI->n_idx]+ 8, pos);
-   long2str(AVI->idx[AVI->n_idx]+12, len);
+   i = AVI->n_idx - AVI->idx_spilled;
+   memcpy(AVI->idx[i],tag,4);
+   long2str(AVI->idx[i]+ 4,flags);
+   long2str(AVI->idx[i]+ 8, pos);
+   long2str(AVI->idx[i]+12, len);
    
    /* Update counter */
 
@@ -203,6 +311,200 @@ static int avi_add_index_entry(avi_t *AVI, unsigned char *tag, long flags, unsig
    return 0;
 }
 
+/* Output the idx1 chunk, the pages in the temporary file first
+   and then the entries in memory */
+
+static int avi_add_idx1(avi_t *AVI)
+{
+   unsigned char c[8];
+   unsigned char *page;
+   off_t off, end;
+   long n;
+
+   if(AVI->idx_spilled == 0)
+     return avi_add_chunk(AVI,(unsigned char *)"idx1",(unsigned char *)AVI->idx,AVI->n_idx*16);
+
+   page = (unsigned char *) malloc(AVI_IDX_PAGE*16);
+   if(page == 0) {
+     AVI_errno = AVI_ERR_NO_MEM;
+     return -1;
+   }
+
+   memcpy(c,"idx1",4);
+   long2str(c+4,AVI->n_idx*16);
+
+   if(avi_out(AVI,c,8)) goto fail;
+
+   end = (off_t)AVI->idx_spilled*16;
+   for(off=0; off<end; off+=n) {
+     n = end-off < AVI_IDX_PAGE*16 ? end-off : AVI_IDX_PAGE*16;
+     if(pread(AVI->idx_fd,page,n,off) != n || avi_out(AVI,page,n)) goto fail;
+   }
+
+   if(avi_out(AVI,(unsigned char *)AVI->idx,(AVI->n_idx-AVI->idx_spilled)*16)) goto fail;
+
+   free(page);
+   AVI->pos += 8 + AVI->n_idx*16;
+   return 0;
+
+fail:
+   free(page);
+   if(!AVI->writer) lseek(AVI->fdes,AVI->pos,SEEK_SET);
+   AVI_errno = AVI_ERR_WRITE;
+   return -1;
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    OpenDML (AVI 2.0): RIFF AVIX chunks follow the first RIFF    *
+ *    chunk, every one ends with an ix00 index of its frames and   *
+ *    the indx super index in the header points to those.          *
+ *                                                                 *
+ *******************************************************************/
+
+/* Entry for the standard index of the current RIFF chunk */
+
+static int avi_odml_add_entry(avi_t *AVI, off_t pos, unsigned long len, int keyframe)
+{
+   void *ptr;
+
+   if(AVI->n_seg>=AVI->max_seg) {
+     ptr = realloc((void *)AVI->seg_idx,(AVI->max_seg+4096)*sizeof(odml_index_entry));
+
+     if(ptr == 0) {
+       AVI_errno = AVI_ERR_NO_MEM;
+       return -1;
+     }
+     AVI->max_seg += 4096;
+     AVI->seg_idx = (odml_index_entry *) ptr;
+   }
+
+   /* the size has bit 31 set for frames that are not key frames */
+
+   AVI->seg_idx[AVI->n_seg].pos = pos;
+   AVI->seg_idx[AVI->n_seg].len = len | (keyframe ? 0 : 0x80000000UL);
+   AVI->n_seg++;
+
+   if(len>AVI->max_len) AVI->max_len=len;
+
+   return 0;
+}
+
+/* Output the ix00 chunk with the frames of the current RIFF chunk
+   and add it to the super index */
+
+static int avi_odml_add_ix(avi_t *AVI)
+{
+   unsigned char *ix;
+   long i, n = AVI->n_seg, length = 24 + 8*n;
+   off_t base, pos = AVI->pos;
+   int ret;
+
+   if(n==0) return 0;
+
+   /* A duplicated frame may point back into the RIFF chunk before */
+
+   base = AVI->seg_idx[0].pos;
+   for(i=1; i<n; i++)
+     if(AVI->seg_idx[i].pos<base) base = AVI->seg_idx[i].pos;
+
+   ix = (unsigned char *) malloc(length);
+   if(ix == 0) {
+     AVI_errno = AVI_ERR_NO_MEM;
+     return -1;
+   }
+
+   ix[0] = 2; ix[1] = 0;             /* LongsPerEntry */
+   ix[2] = 0;                        /* IndexSubType */
+   ix[3] = AVI_INDEX_OF_CHUNKS;      /* IndexType */
+   long2str(ix+ 4,n);                /* EntriesInUse */
+   memcpy(ix+8,"00db",4);            /* ChunkId */
+   long2str(ix+12,base);             /* BaseOffset */
+   long2str(ix+16,(uint64_t)base>>32);
+   long2str(ix+20,0);                /* Reserved */
+
+   /* Offsets are to the data, not to the chunk header */
+
+   for(i=0; i<n; i++) {
+     long2str(ix+24+8*i,AVI->seg_idx[i].pos+8-base);
+     long2str(ix+28+8*i,AVI->seg_idx[i].len);
+   }
+
+   ret = avi_add_chunk(AVI,(unsigned char *)"ix00",ix,length);
+   free(ix);
+   if(ret) return -1;
+
+   AVI->super_idx[AVI->n_super].pos = pos;
+   AVI->super_idx[AVI->n_super].size = 8 + length;
+   AVI->super_idx[AVI->n_super].duration = n;
+   AVI->n_super++;
+   AVI->n_seg = 0;
+
+   return 0;
+}
+
+/* Sizes of a RIFF AVIX chunk and its movi list, once all is written */
+
+static int avi_odml_end_riff(avi_t *AVI)
+{
+   if( avi_patch(AVI,AVI->riff_start+4,AVI->pos-AVI->riff_start-8) ||
+       avi_patch(AVI,AVI->movi_list+4,AVI->pos-AVI->movi_list-8) )
+      return -1;
+   return 0;
+}
+
+/* Make room for a chunk of length bytes: if the current RIFF chunk
+   can not take it with its index, finish it and start the next one */
+
+static int avi_odml_room(avi_t *AVI, unsigned long length)
+{
+   unsigned char c[24];
+   off_t end;
+
+   end = AVI->pos + 8 + PAD_EVEN(length) + 8 + 24 + 8*(AVI->n_seg+1);
+   if(AVI->n_riff == 1) end += 8 + 16*(AVI->n_idx+1);
+
+   if(end - AVI->riff_start <= ODML_RIFF_LEN) return 0;
+
+   /* The super index needs an entry for this chunk and the next */
+
+   if(AVI->n_super+2 > ODML_SUPER_ENTRIES) {
+     AVI_errno = AVI_ERR_SIZELIM;
+     return -1;
+   }
+
+   if(avi_odml_add_ix(AVI)) return -1;
+
+   if(AVI->n_riff == 1) {
+
+     /* AVI 1.0 readers only see the first RIFF chunk, its idx1
+        has the frames in there */
+
+     AVI->movi1_end = AVI->pos;
+     AVI->idx1_ok = avi_add_idx1(AVI) == 0;
+     AVI->riff1_end = AVI->pos;
+     AVI->frames1 = AVI->video_frames;
+   }
+   else if(avi_odml_end_riff(AVI)) return -1;
+
+   /* Sizes are filled in when the chunk is finished */
+
+   memcpy(c,"RIFF",4);    long2str(c+ 4,0); memcpy(c+ 8,"AVIX",4);
+   memcpy(c+12,"LIST",4); long2str(c+16,0); memcpy(c+20,"movi",4);
+
+   if(avi_out(AVI,c,24)) {
+     AVI_errno = AVI_ERR_WRITE;
+     return -1;
+   }
+
+   AVI->riff_start = AVI->pos;
+   AVI->movi_list = AVI->pos + 12;
+   AVI->pos += 24;
+   AVI->n_riff++;
+
+   return 0;
+}
+
 //SLM
 #ifndef S_IRUSR
 #define S_IRWXU       00700       /* read, write, execute: owner */
@@ -280,6 +582,10 @@ avi_t* AVI_open_output_file(char * filename)
    AVI->pos  = HEADERBYTES;
    AVI->mode = AVI_MODE_WRITE; /* open for writing */
 
+   /* Memory for the index does not grow with the recording */
+
+   AVI->idx_fd = avi_idx_tmpfile(filename);
+
    //init
    AVI->anum = 0;
    AVI->aptr = 0;
@@ -287,6 +593,72 @@ avi_t* AVI_open_output_file(char * filename)
    return AVI;
 }
 
+/*
+   AVI_set_writer: Write chunks through a buffer of two blocks of
+                   block bytes, large writes from an I/O thread
+                   instead of two write calls per chunk. See
+                   filewriter.h for flags. The file is the same.
+
+   returns 0 on success, -1 on error
+*/
+
+int AVI_set_writer(avi_t *AVI, long block, int flags)
+{
+   if(AVI->mode==AVI_MODE_READ) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+   if(AVI->writer) return 0;
+
+   AVI->writer = fw_open(AVI->fdes, AVI->pos, block, flags);
+   if(AVI->writer == 0)
+   {
+      AVI_errno = AVI_ERR_NO_MEM;
+      return -1;
+   }
+   return 0;
+}
+
+/*
+   AVI_set_opendml: Write an OpenDML (AVI 2.0) file, more RIFF chunks
+                    follow the first one instead of stopping at
+                    AVI_MAX_LEN. Video only, has to be called before
+                    the first frame is written.
+
+   returns 0 on success, -1 on error
+*/
+
+int AVI_set_opendml(avi_t *AVI)
+{
+   unsigned char zero[1024];
+   long n;
+
+   if(AVI->mode==AVI_MODE_READ) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+   if(AVI->odml) return 0;
+   if(AVI->anum || AVI->pos != HEADERBYTES) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+
+   AVI->super_idx = (odml_super_entry *) calloc(ODML_SUPER_ENTRIES, sizeof(odml_super_entry));
+   if(AVI->super_idx == 0) {
+     AVI_errno = AVI_ERR_NO_MEM;
+     return -1;
+   }
+
+   /* The header grows by the room for the super index */
+
+   memset(zero,0,sizeof(zero));
+   for(n=HEADERBYTES; n<ODML_HEADERBYTES; n+=sizeof(zero)) {
+     if(avi_out(AVI,zero,sizeof(zero))) {
+       AVI_errno = AVI_ERR_WRITE;
+       return -1;
+     }
+   }
+
+   AVI->pos = ODML_HEADERBYTES;
+   AVI->odml = 1;
+   AVI->n_riff = 1;
+   AVI->riff_start = 0;
+   AVI->movi_list = ODML_HEADERBYTES - 12;
+
+   return avi_update_header(AVI);
+}
+
 void AVI_set_video(avi_t *AVI, int width, int height, double fps, char *compressor)
 {
    /* may only be called if file is open for writing */
@@ -314,6 +686,11 @@ void AVI_set_audio(avi_t *AVI, int channels, long rate, int bits, int format, lo
 
    if(AVI->mode==AVI_MODE_READ) return;
 
+   if(AVI->odml) {
+     fprintf(stderr, "error - no audio tracks in OpenDML files\n");
+     return;
+   }
+
    //inc audio tracks
    AVI->aptr=AVI->anum;
    ++AVI->anum;
@@ -332,18 +709,23 @@ void AVI_set_audio(avi_t *AVI, int channels, long rate, int bits, int format, lo
    avi_update_header(AVI);
 }
 
-#define OUT4CC(s) \
-   if(nhb<=HEADERBYTES-4) memcpy(AVI_header+nhb,s,4); nhb += 4
+#define OUT4CC(s) do { \
+   if(nhb<=(long)sizeof(AVI_header)-4) memcpy(AVI_header+nhb,s,4); \
+   nhb += 4; \
+} while(0)
 
-#define OUTLONG(n) \
-   if(nhb<=HEADERBYTES-4) long2str(AVI_header+nhb,n); nhb += 4
+#define OUTLONG(n) do { \
+   if(nhb<=(long)sizeof(AVI_header)-4) long2str(AVI_header+nhb,n); \
+   nhb += 4; \
+} while(0)
 
-#define OUTSHRT(n) \
-   if(nhb<=HEADERBYTES-2) { \
+#define OUTSHRT(n) do { \
+   if(nhb<=(long)sizeof(AVI_header)-2) { \
       AVI_header[nhb  ] = (n   )&0xff; \
       AVI_header[nhb+1] = (n>>8)&0xff; \
    } \
-   nhb += 2
+   nhb += 2; \
+} while(0)
 
 
 //ThOe write preliminary AVI file header: 0 frames, max vid/aud size
@@ -351,11 +733,11 @@ int avi_update_header(avi_t *AVI)
 {
    int njunk, sampsize, hasIndex, ms_per_frame, frate, flag;
    int movi_len, hdrl_start, strl_start, j;
-   unsigned char AVI_header[HEADERBYTES];
-   long nhb;
+   unsigned char AVI_header[ODML_HEADERBYTES];
+   long nhb, hdrbytes = AVI_HEADERBYTES(AVI);
 
    //assume max size
-   movi_len = AVI_MAX_LEN - HEADERBYTES + 4;
+   movi_len = AVI_MAX_LEN - hdrbytes + 4;
 
    //assume index will be written
    hasIndex=1;
@@ -467,6 +849,28 @@ int avi_update_header(avi_t *AVI)
    OUTLONG(0);                  /* ClrUsed: Number of colors used */
    OUTLONG(0);                  /* ClrImportant: Number of colors important */
 
+   /* OpenDML super index, all entries are always there */
+
+   if(AVI->odml) {
+     OUT4CC ("indx");
+     OUTLONG(24+16*ODML_SUPER_ENTRIES);  /* # of bytes to follow */
+     OUTSHRT(4);                  /* LongsPerEntry */
+     OUTSHRT(AVI_INDEX_OF_INDEXES<<8);   /* IndexSubType, IndexType */
+     OUTLONG(AVI->n_super);       /* EntriesInUse */
+     OUT4CC ("00db");             /* ChunkId */
+     OUTLONG(0); OUTLONG(0); OUTLONG(0);  /* Reserved */
+     for(j=0; j<ODML_SUPER_ENTRIES; ++j) {
+       if(j<AVI->n_super) {
+         OUTLONG(AVI->super_idx[j].pos);      /* Offset of the ix00 chunk */
+         OUTLONG((uint64_t)AVI->super_idx[j].pos>>32);
+         OUTLONG(AVI->super_idx[j].size);     /* Size */
+         OUTLONG(AVI->super_idx[j].duration); /* Duration */
+       } else {
+         OUTLONG(0); OUTLONG(0); OUTLONG(0); OUTLONG(0);
+       }
+     }
+   }
+
    /* Finish stream list, i.e. put number of bytes in the list to proper pos */
 
    long2str(AVI_header+strl_start-4,nhb-strl_start);
@@ -535,6 +939,19 @@ int avi_update_header(avi_t *AVI)
        long2str(AVI_header+strl_start-4,nhb-strl_start);
    }
    
+   /* OpenDML extended header, the total of all RIFF chunks */
+
+   if(AVI->odml) {
+     OUT4CC ("LIST");
+     OUTLONG(4+8+248);            /* Length of list in bytes */
+     OUT4CC ("odml");
+     OUT4CC ("dmlh");
+     OUTLONG(248);                /* # of bytes to follow */
+     OUTLONG(0);  /* TotalFrames */
+     memset(AVI_header+nhb,0,244);
+     nhb += 244;
+   }
+
    /* Finish header list */
    
    long2str(AVI_header+hdrl_start-4,nhb-hdrl_start);
@@ -542,7 +959,7 @@ int avi_update_header(avi_t *AVI)
    
    /* Calculate the needed amount of junk bytes, output junk */
    
-   njunk = HEADERBYTES - nhb - 8 - 12;
+   njunk = hdrbytes - nhb - 8 - 12;
    
    /* Safety first: if njunk <= 0, somebody has played with
       HEADERBYTES without knowing what (s)he did.
@@ -576,8 +993,9 @@ int avi_update_header(avi_t *AVI)
    /* Output the header, truncate the file to the number of bytes
       actually written, report an error if someting goes wrong */
 
-   if ( lseek(AVI->fdes,0,SEEK_SET)<0 ||
-        avi_write(AVI->fdes,(char *)AVI_header,HEADERBYTES)!=HEADERBYTES ||
+   if ( avi_sync(AVI)<0 ||
+        lseek(AVI->fdes,0,SEEK_SET)<0 ||
+        avi_write(AVI->fdes,(char *)AVI_header,hdrbytes)!=hdrbytes ||
 	lseek(AVI->fdes,AVI->pos,SEEK_SET)<0)
      {
        AVI_errno = AVI_ERR_CLOSE;
@@ -598,30 +1016,57 @@ static int avi_close_output_file(avi_t *AVI)
    int ret, njunk, sampsize, hasIndex, ms_per_frame, frate, idxerror, flag;
    unsigned long movi_len;
    int hdrl_start, strl_start, j;
-   unsigned char AVI_header[HEADERBYTES];
-   long nhb;
+   unsigned char AVI_header[ODML_HEADERBYTES];
+   long nhb, hdrbytes = AVI_HEADERBYTES(AVI);
 
 #ifdef INFO_LIST
    long info_len;
 //   time_t calptr;
 #endif
 
-   /* Calculate length of movi list */
-
-   movi_len = AVI->pos - HEADERBYTES + 4;
-
    /* Try to ouput the index entries. This may fail e.g. if no space
       is left on device. We will report this as an error, but we still
       try to write the header correctly (so that the file still may be
       readable in the most cases */
 
    idxerror = 0;
-   //   fprintf(stderr, "pos=%lu, index_len=%ld             \n", AVI->pos, AVI->n_idx*16);
-   ret = avi_add_chunk(AVI, (unsigned char *)"idx1", (unsigned char *)AVI->idx, AVI->n_idx*16);
+
+   /* OpenDML: the last RIFF chunk ends with the index of its frames */
+
+   if(AVI->odml && avi_odml_add_ix(AVI)) idxerror = 1;
+
+   if(AVI->n_riff > 1) {
+
+     /* The first RIFF chunk and its idx1 were finished when the
+        second one was started */
+
+     if(avi_odml_end_riff(AVI)) idxerror = 1;
+     movi_len = AVI->movi1_end - hdrbytes + 4;
+     ret = AVI->idx1_ok ? 0 : -1;
+
+   } else {
+
+     /* Calculate length of movi list */
+
+     movi_len = AVI->pos - hdrbytes + 4;
+
+     //   fprintf(stderr, "pos=%lu, index_len=%ld             \n", AVI->pos, AVI->n_idx*16);
+     ret = avi_add_idx1(AVI);
+     AVI->riff1_end = AVI->pos;
+     AVI->frames1 = AVI->video_frames;
+   }
+
+   /* The rest is written directly, the index only made it if
+      everything buffered did */
+
+   if(AVI->writer) {
+     if(fw_close(AVI->writer)<0) ret = -1;
+     AVI->writer = 0;
+   }
    hasIndex = (ret==0);
    //fprintf(stderr, "pos=%lu, index_len=%d\n", AVI->pos, hasIndex);
 
-   if(ret) {
+   if(ret || idxerror) {
      idxerror = 1;
      AVI_errno = AVI_ERR_WRITE_INDEX;
    }
@@ -643,7 +1088,7 @@ static int avi_close_output_file(avi_t *AVI)
    /* The RIFF header */
 
    OUT4CC ("RIFF");
-   OUTLONG(AVI->pos - 8);    /* # of bytes to follow */
+   OUTLONG(AVI->riff1_end - 8);    /* # of bytes to follow */
    OUT4CC ("AVI ");
 
    /* Start the header list */
@@ -676,7 +1121,7 @@ static int avi_close_output_file(avi_t *AVI)
    if(hasIndex) flag |= AVIF_HASINDEX;
    if(hasIndex && AVI->must_use_index) flag |= AVIF_MUSTUSEINDEX;
    OUTLONG(flag);               /* Flags */
-   OUTLONG(AVI->video_frames);  /* TotalFrames */
+   OUTLONG(AVI->frames1);       /* TotalFrames, in the first RIFF chunk */
    OUTLONG(0);                  /* InitialFrames */
 
    OUTLONG(AVI->anum+1);
@@ -739,6 +1184,28 @@ static int avi_close_output_file(avi_t *AVI)
    OUTLONG(0);                  /* ClrUsed: Number of colors used */
    OUTLONG(0);                  /* ClrImportant: Number of colors important */
 
+   /* OpenDML super index, all entries are always there */
+
+   if(AVI->odml) {
+     OUT4CC ("indx");
+     OUTLONG(24+16*ODML_SUPER_ENTRIES);  /* # of bytes to follow */
+     OUTSHRT(4);                  /* LongsPerEntry */
+     OUTSHRT(AVI_INDEX_OF_INDEXES<<8);   /* IndexSubType, IndexType */
+     OUTLONG(AVI->n_super);       /* EntriesInUse */
+     OUT4CC ("00db");             /* ChunkId */
+     OUTLONG(0); OUTLONG(0); OUTLONG(0);  /* Reserved */
+     for(j=0; j<ODML_SUPER_ENTRIES; ++j) {
+       if(j<AVI->n_super) {
+         OUTLONG(AVI->super_idx[j].pos);      /* Offset of the ix00 chunk */
+         OUTLONG((uint64_t)AVI->super_idx[j].pos>>32);
+         OUTLONG(AVI->super_idx[j].size);     /* Size */
+         OUTLONG(AVI->super_idx[j].duration); /* Duration */
+       } else {
+         OUTLONG(0); OUTLONG(0); OUTLONG(0); OUTLONG(0);
+       }
+     }
+   }
+
    /* Finish stream list, i.e. put number of bytes in the list to proper pos */
 
    long2str(AVI_header+strl_start-4,nhb-strl_start);
@@ -809,6 +1276,19 @@ static int avi_close_output_file(avi_t *AVI)
        long2str(AVI_header+strl_start-4,nhb-strl_start);
    }
    
+   /* OpenDML extended header, the total of all RIFF chunks */
+
+   if(AVI->odml) {
+     OUT4CC ("LIST");
+     OUTLONG(4+8+248);            /* Length of list in bytes */
+     OUT4CC ("odml");
+     OUT4CC ("dmlh");
+     OUTLONG(248);                /* # of bytes to follow */
+     OUTLONG(AVI->video_frames);  /* TotalFrames */
+     memset(AVI_header+nhb,0,244);
+     nhb += 244;
+   }
+
    /* Finish header list */
    
    long2str(AVI_header+hdrl_start-4,nhb-hdrl_start);
@@ -854,7 +1334,7 @@ static int avi_close_output_file(avi_t *AVI)
    
    /* Calculate the needed amount of junk bytes, output junk */
    
-   njunk = HEADERBYTES - nhb - 8 - 12;
+   njunk = hdrbytes - nhb - 8 - 12;
    
    /* Safety first: if njunk <= 0, somebody has played with
       HEADERBYTES without knowing what (s)he did.
@@ -882,7 +1362,7 @@ static int avi_close_output_file(avi_t *AVI)
       actually written, report an error if someting goes wrong */
 
    if ( lseek(AVI->fdes,0,SEEK_SET)<0 ||
-        avi_write(AVI->fdes,(char *)AVI_header,HEADERBYTES)!=HEADERBYTES ||
+        avi_write(AVI->fdes,(char *)AVI_header,hdrbytes)!=hdrbytes ||
         ftruncate(AVI->fdes,AVI->pos)<0 )
    {
       AVI_errno = AVI_ERR_CLOSE;
@@ -912,20 +1392,28 @@ static int avi_write_data(avi_t *AVI, char *data, unsigned long length, int audi
 
    /* Check for maximum file length */
    
-   if ( (AVI->pos + 8 + length + 8 + (AVI->n_idx+1)*16) > AVI_MAX_LEN ) {
+   if(AVI->odml) {
+     if(avi_odml_room(AVI,length)) return -1;
+   }
+   else if ( (AVI->pos + 8 + length + 8 + (AVI->n_idx+1)*16) > AVI_MAX_LEN ) {
      AVI_errno = AVI_ERR_SIZELIM;
      return -1;
    }
    
-   /* Add index entry */
+   /* Add index entry, idx1 is only in the first RIFF chunk */
 
    //set tag for current audio track
    sprintf((char *)astr, "0%1dwb", (int)(AVI->aptr+1));
 
-   if(audio)
+   if(AVI->n_riff > 1)
+     n = 0;
+   else if(audio)
      n = avi_add_index_entry(AVI,astr,0x00,AVI->pos,length);
    else
      n = avi_add_index_entry(AVI,(unsigned char *)"00db",((keyframe)?0x10:0x0),AVI->pos,length);
+
+   if(!n && AVI->odml)
+     n = avi_odml_add_entry(AVI,AVI->pos,length,keyframe);
    
    if(n) return -1;
    
@@ -943,7 +1431,7 @@ static int avi_write_data(avi_t *AVI, char *data, unsigned long length, int audi
 
 int AVI_write_frame(avi_t *AVI, char *data, long bytes, int keyframe)
 {
-  unsigned long pos;
+  off_t pos;
   
   if(AVI->mode==AVI_MODE_READ) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
   
@@ -962,7 +1450,8 @@ int AVI_dup_frame(avi_t *AVI)
    if(AVI->mode==AVI_MODE_READ) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
 
    if(AVI->last_pos==0) return 0; /* No previous real frame */
-   if(avi_add_index_entry(AVI,(unsigned char *)"00db",0x10,AVI->last_pos,AVI->last_len)) return -1;
+   if(AVI->n_riff <= 1 && avi_add_index_entry(AVI,(unsigned char *)"00db",0x10,AVI->last_pos,AVI->last_len)) return -1;
+   if(AVI->odml && avi_odml_add_entry(AVI,AVI->last_pos,AVI->last_len,1)) return -1;
    AVI->video_frames++;
    AVI->must_use_index = 1;
    return 0;
@@ -985,17 +1474,18 @@ int AVI_append_audio(avi_t *AVI, char *data, long bytes)
   unsigned char c[4];
 
   if(AVI->mode==AVI_MODE_READ) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+
+  if(avi_sync(AVI)) return -1;
   
   // update last index entry:
   
-  --AVI->n_idx;
-  length = str2ulong(AVI->idx[AVI->n_idx]+12);
-  pos    = str2ulong(AVI->idx[AVI->n_idx]+8);
+  i = AVI->n_idx - AVI->idx_spilled - 1;
+  length = str2ulong(AVI->idx[i]+12);
+  pos    = str2ulong(AVI->idx[i]+8);
 
   //update;
-  long2str(AVI->idx[AVI->n_idx]+12,length+bytes);   
+  long2str(AVI->idx[i]+12,length+bytes);   
 
-  ++AVI->n_idx;
 
   AVI->track[AVI->aptr].audio_bytes += bytes;
 
@@ -1012,6 +1502,8 @@ int AVI_append_audio(avi_t *AVI, char *data, long bytes)
   avi_write(AVI->fdes, data, bytes);
   AVI->pos = pos + 8 + i;
 
+  if(AVI->writer) fw_seek(AVI->writer, AVI->pos);
+
   return 0;
 }
 
@@ -1068,6 +1560,9 @@ int AVI_close(avi_t *AVI)
 
    close(AVI->fdes);
    if(AVI->idx) free(AVI->idx);
+   if(AVI->mode == AVI_MODE_WRITE && AVI->idx_fd >= 0) close(AVI->idx_fd);
+   if(AVI->seg_idx) free(AVI->seg_idx);
+   if(AVI->super_idx) free(AVI->super_idx);
    if(AVI->video_index) free(AVI->video_index);
    //FIXME
    //if(AVI->audio_index) free(AVI->audio_index);
@@ -58,6 +58,21 @@
 
 #define AVI_MAX_TRACKS 8
 
+struct file_writer;
+
+typedef struct
+{
+  off_t pos;               /* Chunk position */
+  unsigned long len;       /* Data bytes, bit 31 set if not a key frame */
+} odml_index_entry;
+
+typedef struct
+{
+  off_t pos;               /* Position of an ix00 chunk */
+  unsigned long size;      /* Its bytes, with the chunk header */
+  unsigned long duration;  /* Frames in it */
+} odml_super_entry;
+
 typedef struct
 {
   off_t key;
@@ -176,6 +191,8 @@ typedef struct
   off_t v_codecf_off;       /* absolut offset of video codec (strf) info */ 
   
   unsigned char (*idx)[16]; /* index entries (AVI idx1 tag) */
+  long   idx_spilled;       /* entries before idx, in idx_fd when writing */
+  int    idx_fd;            /* temporary file for the index, -1 if none */
   video_index_entry *video_index;
   
   off_t last_pos;          /* Position of last frame written */
@@ -188,6 +205,22 @@ typedef struct
   
   BITMAPINFOHEADER_avilib *bitmap_info_header;
   WAVEFORMATEX_avilib *wave_format_ex[AVI_MAX_TRACKS];
+
+  struct file_writer *writer;      /* buffered output, see AVI_set_writer */
+
+  int odml;                        /* OpenDML file, see AVI_set_opendml */
+  int n_riff;                      /* RIFF chunks started */
+  off_t riff_start;                /* Position of the current RIFF chunk */
+  off_t movi_list;                 /* Position of its movi list */
+  off_t movi1_end;                 /* End of the movi list in the first RIFF */
+  off_t riff1_end;                 /* End of the first RIFF, after idx1 */
+  long frames1;                    /* Video frames in the first RIFF */
+  int idx1_ok;                     /* idx1 of the first RIFF was written */
+  odml_index_entry *seg_idx;       /* Frames in the current RIFF chunk */
+  long n_seg;
+  long max_seg;
+  odml_super_entry *super_idx;     /* ix00 chunks written so far */
+  long n_super;
 } avi_t;
 
 #define AVI_MODE_WRITE  0
@@ -258,6 +291,8 @@ typedef struct
 #endif
 
 avi_t* AVI_open_output_file(char * filename);
+int AVI_set_writer(avi_t *AVI, long block, int flags);
+int AVI_set_opendml(avi_t *AVI);
 void AVI_set_video(avi_t *AVI, int width, int height, double fps, char *compressor);
 void AVI_set_audio(avi_t *AVI, int channels, long rate, int bits, int format, long mp3rate);
 int  AVI_write_frame(avi_t *AVI, char *data, long bytes, int keyframe);
@@ -0,0 +1,732 @@
+/*  microbenchmarks of the capture -> encode -> serve pipeline
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <linux/videodev2.h>
+
+#include "v4l2uvc.h"
+#include "jpeg_utils.h"
+#include "pixconv.h"
+#include "cqueue.h"
+#include "spsc.h"
+#include "frame.h"
+#include "ring.h"
+#include "http.h"
+
+/*
+ * No camera needed: every case runs on the same synthetic pictures at all
+ * sizes of resolutions_formats and prints frames/s, ns/pixel and the heap
+ * allocations made per frame, so runs on different machines compare.
+ */
+
+#define BENCH_PORT     8099
+#define BENCH_CLIENTS  8
+#define BENCH_QUALITY  80
+#define QUEUE_SIZE     4
+
+int stop = 0;
+
+static double bench_time = 0.3;
+static int bench_quality = BENCH_QUALITY;
+static int bench_clients = BENCH_CLIENTS;
+static int bench_port = BENCH_PORT;
+static const char *bench_only = NULL;
+
+/* count heap allocations of everybody, libjpeg included (glibc only) */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocs;
+
+void *malloc(size_t size)
+{
+  __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+  __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* fixed pseudo random noise on smooth gradients, like a real picture compresses */
+static void synth_frame(unsigned char *buf, int size, int stride)
+{
+  unsigned int seed = 12345;
+  int i;
+
+  for (i = 0; i < size; i++) {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = (unsigned char)(((i % stride) / 4 + (i / stride) / 2 + ((seed >> 16) & 15)) & 0xff);
+  }
+}
+
+struct bench_result {
+  const char *name;
+  int width, height;
+  unsigned long frames;
+  double elapsed;
+  unsigned long allocs;
+};
+
+static void bench_report(struct bench_result *r)
+{
+  double pixels = (double)r->frames * r->width * r->height;
+
+  printf("%-14s %5dx%-4d %10.1f frames/s %8.2f ns/pixel %6.2f allocs/frame\n",
+         r->name, r->width, r->height, r->frames / r->elapsed,
+         r->elapsed * 1e9 / pixels, (double)r->allocs / r->frames);
+}
+
+static void bench_start(struct bench_result *r, const char *name, int width, int height)
+{
+  r->name = name;
+  r->width = width;
+  r->height = height;
+  r->frames = 0;
+  r->allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+  r->elapsed = now();
+}
+
+/* at least a few frames and bench_time seconds */
+static int bench_running(struct bench_result *r)
+{
+  return r->frames < 3 || now() - r->elapsed < bench_time;
+}
+
+static void bench_stop(struct bench_result *r)
+{
+  r->elapsed = now() - r->elapsed;
+  r->allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - r->allocs;
+  bench_report(r);
+}
+
+static int bench_selected(const char *name)
+{
+  return bench_only == NULL || strstr(name, bench_only) != NULL;
+}
+
+static int compress_frame(struct jpeg_encoder *enc, struct vdIn *vd, unsigned char *jpeg, int size)
+{
+  switch (vd->formatIn) {
+  case V4L2_PIX_FMT_YUYV:
+    return compress_yuyv_to_jpeg(enc, vd, jpeg, size, bench_quality);
+  case V4L2_PIX_FMT_SRGGB8:
+    return compress_rggb_to_jpeg(enc, vd, jpeg, size, bench_quality);
+  default:
+    return compress_rgb_to_jpeg(enc, vd, jpeg, size, bench_quality);
+  }
+}
+
+/* returns the size of the last picture, the fan-out sends it */
+static int bench_compress(const char *name, int format, int width, int height,
+                          unsigned char *jpeg, int size, int report)
+{
+  struct jpeg_encoder *enc = jpeg_encoder_new();
+  struct bench_result r;
+  struct vdIn vd;
+  int bpp, len;
+
+  if (enc == NULL) {
+    return 0;
+  }
+
+  bpp = (format == V4L2_PIX_FMT_YUYV) ? 2 : (format == V4L2_PIX_FMT_SRGGB8) ? 1 : 3;
+  memset(&vd, 0, sizeof(struct vdIn));
+  vd.width = width;
+  vd.height = height;
+  vd.formatIn = format;
+  vd.framebuffer = malloc(width * height * bpp);
+  if (vd.framebuffer == NULL) {
+    jpeg_encoder_free(enc);
+    return 0;
+  }
+  synth_frame(vd.framebuffer, width * height * bpp, width * bpp);
+
+  /* the first frame sets the encoder up, it is not counted */
+  len = compress_frame(enc, &vd, jpeg, size);
+  if (report) {
+    for (bench_start(&r, name, width, height); bench_running(&r); r.frames++) {
+      len = compress_frame(enc, &vd, jpeg, size);
+    }
+    bench_stop(&r);
+  }
+
+  free(vd.framebuffer);
+  jpeg_encoder_free(enc);
+  return len;
+}
+
+/* a frame goes through the queue and back to the pool, like a raw capture */
+static void bench_cqueue(struct frame_pool *pool, int width, int height)
+{
+  struct bench_result r;
+  struct frame *f;
+  cqueue_t q;
+
+  init_queue(&q, QUEUE_SIZE);
+  for (bench_start(&r, "cqueue", width, height); bench_running(&r); r.frames++) {
+    f = frame_pool_get(pool);
+    frame_unref(queue_push(&q, f));
+    frame_unref(queue_pop(&q));
+  }
+  bench_stop(&r);
+  free(q.ele);
+}
+
+static void bench_spsc(struct frame_pool *pool, int width, int height)
+{
+  struct spsc_queue q;
+  struct bench_result r;
+  struct frame *f;
+
+  if (spsc_init(&q, QUEUE_SIZE) < 0) {
+    return;
+  }
+  for (bench_start(&r, "spsc", width, height); bench_running(&r); r.frames++) {
+    f = frame_pool_get(pool);
+    if (spsc_push(&q, f) < 0) {
+      frame_unref(f);
+    }
+    frame_unref(spsc_trypop(&q));
+  }
+  bench_stop(&r);
+  spsc_destroy(&q);
+}
+
+/*
+ * HTTP fan-out: the event driven server sends every frame to all clients,
+ * the next frame is published once all of them have received the last one.
+ */
+struct fanout {
+  struct frame_ring ring;
+  struct frame_pool pool;
+  int epfd;
+  int *fds;
+  unsigned long *received;
+  unsigned long expected;
+  pthread_t server;
+  pthread_t reader;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static void *fanout_server(void *arg)
+{
+  http_listener(&server);
+  return NULL;
+}
+
+static void *fanout_reader(void *arg)
+{
+  struct fanout *fo = (struct fanout *)arg;
+  struct epoll_event events[BENCH_CLIENTS * 4];
+  char buf[65536];
+  int i, n, len;
+
+  while (!stop) {
+    n = epoll_wait(fo->epfd, events, BENCH_CLIENTS * 4, 100);
+    for (i = 0; i < n; i++) {
+      len = read(fo->fds[events[i].data.u32], buf, sizeof(buf));
+      if (len <= 0) {
+        continue;
+      }
+      pthread_mutex_lock(&fo->lock);
+      fo->received[events[i].data.u32] += len;
+      pthread_cond_signal(&fo->cond);
+      pthread_mutex_unlock(&fo->lock);
+    }
+  }
+  return NULL;
+}
+
+/* wait until every client has "expected" bytes */
+static int fanout_wait(struct fanout *fo)
+{
+  struct timespec ts;
+  int i, done = 0;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += 5;
+
+  pthread_mutex_lock(&fo->lock);
+  while (!done) {
+    for (done = 1, i = 0; i < bench_clients; i++) {
+      if (fo->received[i] < fo->expected) {
+        done = 0;
+      }
+    }
+    if (!done && pthread_cond_timedwait(&fo->cond, &fo->lock, &ts) == ETIMEDOUT) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&fo->lock);
+  return done ? 0 : -1;
+}
+
+static int fanout_start(struct fanout *fo, int capacity)
+{
+  static const char request[] = "GET /stream.mjpeg HTTP/1.0\r\n\r\n";
+  struct sockaddr_in addr;
+  struct epoll_event ev;
+  int i;
+
+  memset(fo, 0, sizeof(struct fanout));
+  ring_init(&fo->ring);
+  frame_pool_init(&fo->pool, capacity);
+  pthread_mutex_init(&fo->lock, NULL);
+  pthread_cond_init(&fo->cond, NULL);
+  fo->fds = calloc(bench_clients, sizeof(int));
+  fo->received = calloc(bench_clients, sizeof(unsigned long));
+  fo->epfd = epoll_create1(0);
+
+  server.port = htons(bench_port);
+  server.username = "bench";
+  server.ring = &fo->ring;
+  server.event_threads = 1;
+  if (pthread_create(&fo->server, NULL, fanout_server, NULL) != 0) {
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(bench_port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  for (i = 0; i < bench_clients; i++) {
+    fo->fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+    /* the server may not listen yet */
+    while (connect(fo->fds[i], (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      if (errno != ECONNREFUSED) {
+        perror("connect");
+        return -1;
+      }
+      usleep(10000);
+    }
+    if (write(fo->fds[i], request, sizeof(request) - 1) < 0) {
+      perror("write");
+      return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    epoll_ctl(fo->epfd, EPOLL_CTL_ADD, fo->fds[i], &ev);
+  }
+
+  if (pthread_create(&fo->reader, NULL, fanout_reader, fo) != 0) {
+    return -1;
+  }
+
+  /* the stream header says the server took the request, take it as the base */
+  fo->expected = 1;
+  if (fanout_wait(fo) < 0) {
+    fprintf(stderr, "fan-out clients got no answer\n");
+    return -1;
+  }
+  usleep(100000);
+  pthread_mutex_lock(&fo->lock);
+  for (i = 0; i < bench_clients; i++) {
+    if (fo->received[i] > fo->expected) {
+      fo->expected = fo->received[i];
+    }
+  }
+  pthread_mutex_unlock(&fo->lock);
+  return 0;
+}
+
+static void bench_fanout(struct fanout *fo, unsigned char *jpeg, int len, int width, int height)
+{
+  struct bench_result r;
+  struct frame *f;
+  char name[32];
+
+  snprintf(name, sizeof(name), "http x%d", bench_clients);
+  for (bench_start(&r, name, width, height); bench_running(&r); r.frames++) {
+    f = frame_pool_get(&fo->pool);
+    memcpy(f->buff, jpeg, len);
+    f->size = len;
+    /* a fixed time stamp keeps the part header length fixed */
+    f->timestamp.tv_sec = 1000000000;
+    f->timestamp.tv_usec = 0;
+    http_frame_part(f);
+    fo->expected += f->partlen + f->size;
+    ring_publish(&fo->ring, f);
+    if (fanout_wait(fo) < 0) {
+      fprintf(stderr, "fan-out stalled\n");
+      break;
+    }
+  }
+  bench_stop(&r);
+}
+
+static void fanout_stop(struct fanout *fo)
+{
+  int i;
+
+  stop = 1;
+  ring_stop(&fo->ring);
+  pthread_join(fo->reader, NULL);
+  pthread_join(fo->server, NULL);
+  for (i = 0; i < bench_clients; i++) {
+    close(fo->fds[i]);
+  }
+  close(fo->epfd);
+  close(server.sd);
+  ring_destroy(&fo->ring);
+  frame_pool_destroy(&fo->pool);
+}
+
+/*
+ * Bit exactness of the pixel conversion: every variant the CPU can run is
+ * held against the scalar one on random lines of all widths up to
+ * CHECK_WIDTH and a few camera sized ones, from unaligned buffers. The
+ * outputs start out as the same random bytes, so a variant that writes
+ * past its line or leaves a byte out shows up too.
+ */
+#define CHECK_WIDTH    256
+#define CHECK_MAX      2600
+#define CHECK_GUARD    64
+#define CHECK_ROUNDS   4
+#define CHECK_IN       (CHECK_MAX * 2 + 2 * CHECK_GUARD)
+#define CHECK_OUT      (CHECK_MAX * 3 + 4 * CHECK_GUARD)
+
+static const int check_wide[] = { 320, 640, 1279, 1280, 1920, 1947, 2592 };
+
+static const char *check_kernels[] = { "yuyv_split", "yuyv_split_avg", "rggb_to_rgb" };
+
+static unsigned int check_seed = 1;
+
+static void check_random(unsigned char *buf, int size)
+{
+  int i;
+
+  for (i = 0; i < size; i++) {
+    check_seed = check_seed * 1103515245 + 12345;
+    buf[i] = (unsigned char)(check_seed >> 16);
+  }
+}
+
+/* y, u and v follow each other with a guard in between */
+static void check_run(const struct pixconv *pc, int kernel, const unsigned char *in,
+                      unsigned char *out, int width)
+{
+  unsigned char *u = out + width + CHECK_GUARD;
+  unsigned char *v = u + width / 2 + CHECK_GUARD;
+
+  switch (kernel) {
+  case 0:
+    pc->yuyv_split(in, out, u, v, width);
+    break;
+  case 1:
+    pc->yuyv_split_avg(in, out, u, v, width);
+    break;
+  default:
+    pc->rggb_to_rgb(in, out, width);
+    break;
+  }
+}
+
+/* a variant without a kernel of its own has the scalar one */
+static int check_scalar(const struct pixconv *pc, const struct pixconv *ref, int kernel)
+{
+  switch (kernel) {
+  case 0:
+    return pc->yuyv_split == ref->yuyv_split;
+  case 1:
+    return pc->yuyv_split_avg == ref->yuyv_split_avg;
+  default:
+    return pc->rggb_to_rgb == ref->rggb_to_rgb;
+  }
+}
+
+/* one line at one width, returns 1 on a mismatch */
+static int check_line(const struct pixconv *pc, const struct pixconv *ref, int kernel, int width,
+                      int round, unsigned char *in, unsigned char *out, unsigned char *expect)
+{
+  int off = round * 5 % 16, i;
+
+  check_random(in, CHECK_IN);
+  check_random(out, CHECK_OUT);
+  memcpy(expect, out, CHECK_OUT);
+
+  check_run(ref, kernel, in + off, expect + off, width);
+  check_run(pc, kernel, in + off, out + off, width);
+
+  for (i = 0; i < CHECK_OUT; i++) {
+    if (out[i] != expect[i]) {
+      printf("%-14s %-6s width %d offset %d: byte %d is %d, not %d\n", check_kernels[kernel],
+             pc->name, width, off, i - off, out[i], expect[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* returns the number of lines that came out different */
+static int check_pixconv(void)
+{
+  const struct pixconv *list[PIXCONV_VARIANTS];
+  unsigned char *in, *out, *expect;
+  int n, v, kernel, width, i, round, lines, failed, total = 0;
+
+  pixconv_init();
+  n = pixconv_variants(list, PIXCONV_VARIANTS);
+  printf("Pixel conversion: %s, checking %d variants against %s\n",
+         pixconv.name, n - 1, list[0]->name);
+
+  in = malloc(CHECK_IN);
+  out = malloc(CHECK_OUT);
+  expect = malloc(CHECK_OUT);
+
+  for (v = 1; v < n; v++) {
+    for (kernel = 0; kernel < 3; kernel++) {
+      if (check_scalar(list[v], list[0], kernel)) {
+        printf("%-14s %-6s is the scalar one\n", check_kernels[kernel], list[v]->name);
+        continue;
+      }
+      lines = 0;
+      failed = 0;
+      for (i = 0; i < CHECK_WIDTH + (int)(sizeof(check_wide) / sizeof(check_wide[0])); i++) {
+        width = i < CHECK_WIDTH ? i + 1 : check_wide[i - CHECK_WIDTH];
+        for (round = 0; round < CHECK_ROUNDS; round++) {
+          failed += check_line(list[v], list[0], kernel, width, round, in, out, expect);
+          lines++;
+        }
+      }
+      printf("%-14s %-6s %6d lines, %d different\n", check_kernels[kernel], list[v]->name,
+             lines, failed);
+      total += failed;
+    }
+  }
+
+  free(in);
+  free(out);
+  free(expect);
+  return total;
+}
+
+/*
+ * Pipelined requests on the event server: a fresh snapshot, a second one
+ * sent while the first waits for its frame, then the client shuts down its
+ * side. Both have to be answered, then the server closes. Returns 1 if not.
+ */
+static int check_pipeline(void)
+{
+  static const char request[] = "GET /snapshot.jpeg?fresh=1 HTTP/1.1\r\n\r\n";
+  struct frame_ring ring;
+  struct frame_pool pool;
+  struct sockaddr_in addr;
+  struct frame *f;
+  struct pollfd pfd;
+  pthread_t thread;
+  char buf[4096], *p;
+  int fd, n, len = 0, answers = 0, closed = 0, i;
+
+  ring_init(&ring);
+  frame_pool_init(&pool, 64);
+  server.port = htons(bench_port);
+  server.username = "bench";
+  server.ring = &ring;
+  server.event_threads = 1;
+  if (pthread_create(&thread, NULL, fanout_server, NULL) != 0) {
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(bench_port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  while (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (errno != ECONNREFUSED) {
+      perror("connect");
+      return 1;
+    }
+    usleep(10000);
+  }
+  if (write(fd, request, sizeof(request) - 1) < 0) {
+    perror("write");
+    return 1;
+  }
+  /* the first request waits for a frame when the second one comes */
+  usleep(100000);
+  if (write(fd, request, sizeof(request) - 1) < 0 || shutdown(fd, SHUT_WR) < 0) {
+    perror("write");
+    return 1;
+  }
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  /* a frame every 10 ms, for 2 s at most */
+  for (i = 0; i < 200 && !closed; i++) {
+    f = frame_pool_get(&pool);
+    memset(f->buff, 0, 16);
+    f->size = 16;
+    gettimeofday(&f->timestamp, NULL);
+    http_frame_part(f);
+    ring_publish(&ring, f);
+
+    while (!closed && poll(&pfd, 1, 10) > 0) {
+      n = read(fd, buf + len, sizeof(buf) - len);
+      if (n <= 0) {
+        closed = 1;
+        break;
+      }
+      len += n;
+    }
+  }
+  /* every status line is an answer, the pictures are zeros */
+  for (p = buf; (p = memmem(p, buf + len - p, "HTTP/1.", 7)) != NULL; p++) {
+    answers++;
+  }
+  printf("%-14s %-6s %6d answers, %s\n", "pipeline", "http", answers,
+         closed ? "closed" : "left open");
+
+  stop = 1;
+  ring_stop(&ring);
+  pthread_join(thread, NULL);
+  close(fd);
+  close(server.sd);
+  ring_destroy(&ring);
+  frame_pool_destroy(&pool);
+  return answers != 2 || !closed;
+}
+
+static void help(char *progname)
+{
+  fprintf(stderr, "Usage: %s\n"
+    " [-t ]                  seconds per case (default 0.3)\n"
+    " [-q ]                  compression quality (default %d)\n"
+    " [-c ]                  HTTP fan-out clients (default %d, max %d)\n"
+    " [-p ]                  TCP port of the fan-out server (default %d)\n"
+    " [-o ]                  only run cases whose name contains this\n"
+    " [-C ]                  check pixel conversion and pipelined HTTP, no benchmarks\n"
+    "\n", progname, BENCH_QUALITY, BENCH_CLIENTS, BENCH_CLIENTS, BENCH_PORT);
+}
+
+int main(int argc, char *argv[])
+{
+  struct frame_pool pool;
+  struct fanout fo;
+  unsigned char *jpeg;
+  int i, c, len, width, height, size, fanout = 0;
+
+  while ((c = getopt(argc, argv, "ht:q:c:p:o:C")) != -1) {
+    switch (c) {
+      case 't':
+        bench_time = atof(optarg);
+        break;
+      case 'q':
+        bench_quality = atoi(optarg);
+        break;
+      case 'c':
+        bench_clients = atoi(optarg);
+        if (bench_clients < 1 || bench_clients > BENCH_CLIENTS) {
+          bench_clients = BENCH_CLIENTS;
+        }
+        break;
+      case 'p':
+        bench_port = atoi(optarg);
+        break;
+      case 'o':
+        bench_only = optarg;
+        break;
+      case 'C':
+        return (check_pixconv() + check_pipeline()) != 0;
+      default:
+        help(argv[0]);
+        return 0;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  pixconv_init();
+  printf("Pixel conversion: %s, quality %d, %.1f s per case\n",
+         pixconv.name, bench_quality, bench_time);
+
+  /* the largest picture sets the buffer sizes */
+  size = 0;
+  for (i = 0; i < NB_RESOLUTIONS; i++) {
+    if (resolutions_formats[i].width * resolutions_formats[i].height * 3 > size) {
+      size = resolutions_formats[i].width * resolutions_formats[i].height * 3;
+    }
+  }
+  jpeg = malloc(size);
+  frame_pool_init(&pool, 64);
+
+  if (bench_selected("http")) {
+    if (fanout_start(&fo, size) < 0) {
+      return 1;
+    }
+    fanout = 1;
+  }
+
+  for (i = 0; i < NB_RESOLUTIONS; i++) {
+    width = resolutions_formats[i].width;
+    height = resolutions_formats[i].height;
+
+    if (bench_selected("compress_rggb")) {
+      bench_compress("compress_rggb", V4L2_PIX_FMT_SRGGB8, width, height, jpeg, size, 1);
+    }
+    if (bench_selected("compress_rgb")) {
+      bench_compress("compress_rgb", V4L2_PIX_FMT_RGB24, width, height, jpeg, size, 1);
+    }
+    /* always encoded, the fan-out sends this picture */
+    len = bench_compress("compress_yuyv", V4L2_PIX_FMT_YUYV, width, height, jpeg, size,
+                         bench_selected("compress_yuyv"));
+
+    if (bench_selected("cqueue")) {
+      bench_cqueue(&pool, width, height);
+    }
+    if (bench_selected("spsc")) {
+      bench_spsc(&pool, width, height);
+    }
+    if (fanout && len > 0) {
+      bench_fanout(&fo, jpeg, len, width, height);
+    }
+  }
+
+  if (fanout) {
+    fanout_stop(&fo);
+  }
+  frame_pool_destroy(&pool);
+  free(jpeg);
+  return 0;
+}
@@ -29,16 +29,28 @@ void *queue_front(cqueue_t * q)
 	return q->ele[q->front];
 }
 
-void queue_push(cqueue_t * q, void *item)
+void *queue_back(cqueue_t * q)
 {
+	if(is_empty(q)) {
+		return NULL;
+	}
+	return q->ele[q->rear];
+}
+
+/* returns the oldest element if it had to be dropped to make room */
+void *queue_push(cqueue_t * q, void *item)
+{
+    void *dropped = NULL;
+
     if( is_full(q) ) {
        /*printf("Queue Overflow\n");*/
-       q->count--;
+       dropped = queue_pop(q);
     }
 
     q->rear = (q->rear+1) % q->max;
     q->ele[q->rear] = item;
     q->count++;
+    return dropped;
 }
 
 void * queue_pop(cqueue_t * q)
@@ -11,7 +11,8 @@ typedef struct {
 
 void init_queue(cqueue_t * q, int size);
 void *queue_front(cqueue_t * q);
-void queue_push(cqueue_t * q, void *item);
+void *queue_back(cqueue_t * q);
+void *queue_push(cqueue_t * q, void *item);
 void * queue_pop(cqueue_t * q);
 
 #endif
\ No newline at end of file
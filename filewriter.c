@@ -0,0 +1,270 @@
+/*  buffered file writer, large writes from an I/O thread
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "filewriter.h"
+
+/* blocks are multiples of a page, so are their buffers and file offsets */
+#define FW_ALIGN  4096
+
+/* a block starts at off and ends at a multiple of the block size */
+static void fw_next(struct file_writer *w, struct fw_block *next, off_t off)
+{
+  next->off = off;
+  next->len = 0;
+  next->room = w->block - (size_t)(off % w->block);
+}
+
+static int fw_pwrite(int fd, const unsigned char *data, size_t len, off_t off)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = pwrite(fd, data, len, off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+/* I/O thread side, one block to the file */
+static int fw_store(struct file_writer *w, struct fw_block *b)
+{
+  off_t end = b->off + b->len;
+
+  /*
+   * fewer, larger extents. The file size is left alone, after a crash the
+   * file ends where the last write did and not in a run of zeros.
+   */
+  if ((w->flags & FW_PREALLOC) && end > w->reserved) {
+    if (fallocate(w->fd, FALLOC_FL_KEEP_SIZE, b->off, FW_PREALLOC_STEP) == 0) {
+      w->reserved = b->off + FW_PREALLOC_STEP;
+    } else {
+      w->flags &= ~FW_PREALLOC;
+    }
+  }
+
+  if (fw_pwrite(w->fd, b->data, b->len, b->off) < 0) {
+    return -1;
+  }
+
+  /*
+   * Start the write back of this block and wait for the one before, then
+   * drop it from the page cache. Dirty pages never pile up and are written
+   * a block at a time, not in a burst when the kernel gets to them.
+   */
+  if (w->flags & FW_DROP_CACHE) {
+    sync_file_range(w->fd, b->off, b->len, SYNC_FILE_RANGE_WRITE);
+    if (w->done_len) {
+      sync_file_range(w->fd, w->done_off, w->done_len,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+      posix_fadvise(w->fd, w->done_off, w->done_len, POSIX_FADV_DONTNEED);
+    }
+    w->done_off = b->off;
+    w->done_len = b->len;
+  }
+  return 0;
+}
+
+static void *fw_thread(void *arg)
+{
+  struct file_writer *w = (struct file_writer *)arg;
+  struct fw_block *b;
+  int ret;
+
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (w->pending < 0 && !w->stop) {
+      pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if (w->pending < 0) {
+      break;
+    }
+    b = &w->blocks[w->pending];
+    pthread_mutex_unlock(&w->lock);
+
+    ret = fw_store(w, b);
+
+    pthread_mutex_lock(&w->lock);
+    if (ret < 0 && !w->error) {
+      __atomic_store_n(&w->error, errno, __ATOMIC_RELAXED);
+    }
+    b->len = 0;
+    w->pending = -1;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+/* caller side, hand the block being filled to the I/O thread */
+static void fw_submit(struct file_writer *w)
+{
+  struct fw_block *b = &w->blocks[w->cur];
+  /* b belongs to the I/O thread once handed over */
+  off_t end = b->off + b->len;
+
+  pthread_mutex_lock(&w->lock);
+  while (w->pending >= 0) {
+    pthread_cond_wait(&w->cond, &w->lock);
+  }
+  w->pending = w->cur;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+
+  w->cur ^= 1;
+  fw_next(w, &w->blocks[w->cur], end);
+}
+
+/* appends start at pos, block is rounded up to whole pages */
+struct file_writer *fw_open(int fd, off_t pos, size_t block, int flags)
+{
+  struct file_writer *w;
+  int i;
+
+  w = (struct file_writer *)calloc(1, sizeof(struct file_writer));
+  if (w == NULL) {
+    return NULL;
+  }
+  w->fd = fd;
+  w->flags = flags;
+  w->block = (block + FW_ALIGN - 1) & ~(size_t)(FW_ALIGN - 1);
+  if (w->block == 0) {
+    w->block = FW_ALIGN;
+  }
+  w->pending = -1;
+  w->reserved = pos;
+
+  for (i = 0; i < 2; i++) {
+    if (posix_memalign((void **)&w->blocks[i].data, FW_ALIGN, w->block) != 0) {
+      w->blocks[i].data = NULL;
+      goto fail;
+    }
+  }
+  fw_next(w, &w->blocks[0], pos);
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  if (pthread_create(&w->thread, NULL, fw_thread, w) != 0) {
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    goto fail;
+  }
+  return w;
+
+fail:
+  free(w->blocks[0].data);
+  free(w->blocks[1].data);
+  free(w);
+  return NULL;
+}
+
+/* copy data at the end of the file, -1 once a write has failed */
+int fw_write(struct file_writer *w, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  struct fw_block *b;
+  size_t n;
+
+  if (__atomic_load_n(&w->error, __ATOMIC_RELAXED)) {
+    errno = w->error;
+    return -1;
+  }
+
+  while (len > 0) {
+    b = &w->blocks[w->cur];
+    n = b->room - b->len;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    p += n;
+    len -= n;
+
+    if (b->len == b->room) {
+      fw_submit(w);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Wait until everything appended is in the file, after that the caller may
+ * write elsewhere in the file itself. Returns -1 if any write failed.
+ */
+int fw_flush(struct file_writer *w)
+{
+  int error;
+
+  if (w->blocks[w->cur].len > 0) {
+    fw_submit(w);
+  }
+
+  pthread_mutex_lock(&w->lock);
+  while (w->pending >= 0) {
+    pthread_cond_wait(&w->cond, &w->lock);
+  }
+  error = w->error;
+  pthread_mutex_unlock(&w->lock);
+
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+/* after fw_flush(), the next append goes to pos */
+void fw_seek(struct file_writer *w, off_t pos)
+{
+  fw_next(w, &w->blocks[w->cur], pos);
+}
+
+/* flush and stop the I/O thread, the file stays open */
+int fw_close(struct file_writer *w)
+{
+  int ret = fw_flush(w);
+  off_t end = w->blocks[w->cur].off;
+  struct stat st;
+
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+
+  /* give back what was reserved past the end, the size does not change */
+  if (w->reserved > end && fstat(w->fd, &st) == 0 && ftruncate(w->fd, st.st_size) < 0) {
+    ret = -1;
+  }
+
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->lock);
+  free(w->blocks[0].data);
+  free(w->blocks[1].data);
+  free(w);
+  return ret;
+}
@@ -0,0 +1,67 @@
+/*  buffered file writer, large writes from an I/O thread
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#ifndef _FILEWRITER_H
+#define _FILEWRITER_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* grow the file in large steps before writing to it */
+#define FW_PREALLOC     1
+/* write back and drop from the page cache what has been written */
+#define FW_DROP_CACHE   2
+
+/* room reserved at a time with FW_PREALLOC */
+#define FW_PREALLOC_STEP  (64 << 20)
+
+struct fw_block {
+  unsigned char *data;
+  size_t len;
+  /* bytes that fit, the block ends at a multiple of the block size */
+  size_t room;
+  off_t off;
+};
+
+/*
+ * Appends to a file through two blocks: the caller fills one while the I/O
+ * thread writes the other, a full block costs one pwrite(). The caller only
+ * waits when both blocks are full. A write error is kept and returned by
+ * every call after it.
+ */
+struct file_writer {
+  int fd;
+  int flags;
+  size_t block;
+  struct fw_block blocks[2];
+  /* block being filled */
+  int cur;
+  /* block handed to the I/O thread, -1 if none */
+  int pending;
+  int stop;
+  int error;
+  /* end of the room reserved with FW_PREALLOC */
+  off_t reserved;
+  /* last block written, to be dropped from the page cache */
+  off_t done_off;
+  size_t done_len;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+};
+
+struct file_writer *fw_open(int fd, off_t pos, size_t block, int flags);
+int fw_write(struct file_writer *w, const void *data, size_t len);
+int fw_flush(struct file_writer *w);
+void fw_seek(struct file_writer *w, off_t pos);
+int fw_close(struct file_writer *w);
+
+#endif
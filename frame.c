@@ -0,0 +1,128 @@
+/*  reference counted frame buffers
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "frame.h"
+
+/* the clock of struct frame_times */
+uint64_t frame_clock(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+struct frame *frame_ref(struct frame *f)
+{
+  __atomic_add_fetch(&f->refcount, 1, __ATOMIC_RELAXED);
+  return f;
+}
+
+/* take a reference unless the frame has already been released */
+struct frame *frame_tryref(struct frame *f)
+{
+  int n = __atomic_load_n(&f->refcount, __ATOMIC_RELAXED);
+
+  do {
+    if (n == 0) {
+      return NULL;
+    }
+  } while (!__atomic_compare_exchange_n(&f->refcount, &n, n + 1, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+  return f;
+}
+
+void frame_unref(struct frame *f)
+{
+  if (f == NULL) {
+    return;
+  }
+
+  if (__atomic_sub_fetch(&f->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    f->release(f);
+  }
+}
+
+static void frame_pool_release(struct frame *f)
+{
+  struct frame_pool *pool = (struct frame_pool *)f->priv;
+
+  pthread_mutex_lock(&pool->lock);
+  f->next = pool->free;
+  pool->free = f;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void frame_pool_init(struct frame_pool *pool, int capacity)
+{
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->free = NULL;
+  pool->capacity = capacity;
+}
+
+/*
+ * Take a free frame from the pool, a new one is allocated when all are in
+ * use. Frames are only freed by frame_pool_destroy(), readers of the frame
+ * ring rely on that.
+ */
+struct frame *frame_pool_get(struct frame_pool *pool)
+{
+  struct frame *f;
+
+  pthread_mutex_lock(&pool->lock);
+  f = pool->free;
+  if (f) {
+    pool->free = f->next;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (f == NULL) {
+    f = (struct frame *)calloc(1, sizeof(struct frame));
+    if (f == NULL) {
+      return NULL;
+    }
+    f->buff = (unsigned char *)calloc(1, (size_t)pool->capacity);
+    if (f->buff == NULL) {
+      free(f);
+      return NULL;
+    }
+    f->capacity = pool->capacity;
+    f->index = -1;
+    f->priv = pool;
+    f->release = frame_pool_release;
+  }
+
+  f->next = NULL;
+  f->size = 0;
+  memset(&f->times, 0, sizeof(struct frame_times));
+  __atomic_store_n(&f->refcount, 1, __ATOMIC_RELEASE);
+  return f;
+}
+
+/* free the frames returned to the pool, frames still referenced are leaked */
+void frame_pool_destroy(struct frame_pool *pool)
+{
+  struct frame *f;
+
+  pthread_mutex_lock(&pool->lock);
+  while ((f = pool->free) != NULL) {
+    pool->free = f->next;
+    free(f->buff);
+    free(f);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  pthread_mutex_destroy(&pool->lock);
+}
@@ -0,0 +1,78 @@
+/*  reference counted frame buffers
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#ifndef _FRAME_H
+#define _FRAME_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#define FRAME_PART_MAX 128
+
+/*
+ * CLOCK_MONOTONIC nanoseconds at which a picture passed the pipeline
+ * stages, 0 for stages it did not go through. "driver" is the capture
+ * time the V4L2 driver reported.
+ */
+struct frame_times {
+  uint64_t driver;
+  uint64_t dequeue;
+  uint64_t encode_start;
+  uint64_t encode_end;
+  uint64_t publish;
+};
+
+/*
+ * A frame is an encoded picture shared by the camera thread and all its
+ * consumers. Whoever drops the last reference hands the frame back to its
+ * owner through the release callback (frame pool or V4L2 driver queue).
+ */
+struct frame {
+  int refcount;
+  int size;
+  int capacity;
+  unsigned char *buff;
+  struct timeval timestamp;
+  struct frame_times times;
+  /* multipart header, built once and shared by all streaming clients */
+  char part[FRAME_PART_MAX];
+  int partlen;
+  /*
+   * Live frames are published before they are encoded: "ready" bytes of
+   * buff are final, "done" is set once size is known (0 if it failed).
+   */
+  int ready;
+  int done;
+  /* recorder sequence number, taken at capture */
+  unsigned int seq;
+  int index;
+  void *priv;
+  void (*release)(struct frame *f);
+  struct frame *next;
+};
+
+struct frame_pool {
+  pthread_mutex_t lock;
+  struct frame *free;
+  int capacity;
+};
+
+uint64_t frame_clock(void);
+
+struct frame *frame_ref(struct frame *f);
+struct frame *frame_tryref(struct frame *f);
+void frame_unref(struct frame *f);
+
+void frame_pool_init(struct frame_pool *pool, int capacity);
+struct frame *frame_pool_get(struct frame_pool *pool);
+void frame_pool_destroy(struct frame_pool *pool);
+
+#endif
@@ -8,9 +8,12 @@
  *  (at your option) any later version.
  *
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
@@ -19,15 +22,24 @@
 #include <sys/ioctl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 
 #include "md5.h"
-#include "cqueue.h"
+#include "frame.h"
+#include "ring.h"
 #include "http.h"
+#include "metrics.h"
 
 #define SNAPSHOT_HEADER "HTTP/1.0 200 OK\r\n" \
   "Server: UVC Streamer\r\n" \
   "Access-Control-Allow-Origin: *\r\n" \
   "Content-type: image/jpeg\r\n" \
+  "Content-Length: %d\r\n" \
+  "X-Timestamp: %ld.%06ld\r\n" \
+  "Connection: %s\r\n" \
   "\r\n"
 
 #define STREAM_HEADER "HTTP/1.0 200 OK\r\n" \
@@ -39,8 +51,25 @@
   "Access-Control-Allow-Origin: *\r\n" \
   "\r\n"
 
-#define STREAM_HEADER_CHUNK "--" BOUNDARY "\n" \
-  "Content-type: image/jpeg\n\n"
+#define STREAM_HEADER_CHUNK "\r\n--" BOUNDARY "\r\n" \
+  "Content-Type: image/jpeg\r\n" \
+  "Content-Length: %d\r\n" \
+  "X-Timestamp: %ld.%06ld\r\n" \
+  "\r\n"
+
+#define REPORT_HEADER "HTTP/1.0 200 OK\r\n" \
+  "Server: UVC Streamer\r\n" \
+  "Content-Type: text/plain%s\r\n" \
+  "Content-Length: %d\r\n" \
+  "Cache-Control: no-cache\r\n" \
+  "Connection: %s\r\n" \
+  "\r\n"
+
+/* live parts are sent while the picture is encoded, the size is not known */
+#define LIVE_HEADER_CHUNK "\r\n--" BOUNDARY "\r\n" \
+  "Content-Type: image/jpeg\r\n" \
+  "X-Timestamp: %ld.%06ld\r\n" \
+  "\r\n"
 
 #define AUTH_HEADER "HTTP/1.1 401 Unauthorized\n"\
   "Access-Control-Allow-Origin: *\r\n" \
@@ -90,16 +119,35 @@ static char not_found_request_response[] =
 #define NONCE         1234
 #define STREAM_URI    "/stream.mjpeg"
 #define SNAPSHOT_URI  "/snapshot.jpeg"
+#define METRICS_URI   "/metrics"
+#define LATENCY_URI   "/latency"
 #define BUFF_MAX      1024
+#define RBUF_MAX      4096
 #define READ_TIMEOUT  30
+#define FPS_MIN       0.001
+#define EVENT_MAX     64
 
 extern int stop;
 
+struct http_server server;
+
 
 struct http_header {
   char *method;
   char *uri;
   char *auth;
+  char *etag;
+  char *range;
+  char *connection;
+  int http11;
+  int keep_alive;
+};
+
+/* receive buffer, may hold the start of the next pipelined request */
+struct http_rbuf {
+  int len;
+  int scan;
+  char data[RBUF_MAX];
 };
 
 struct http_digest_auth {
@@ -108,15 +156,94 @@ struct http_digest_auth {
   char opaque[33];
 };
 
+typedef enum { CONN_READ, CONN_SEND, CONN_WAIT_FRAME, CONN_WAIT_DATA, CONN_PACE } conn_state_t;
+
+/* connection of the event driven server */
+struct http_conn {
+  struct clientArgs ca;
+  conn_state_t state;
+  int events;
+  time_t since;
+  struct http_rbuf *rbuf;
+  char hbuf[BUFF_MAX];
+  const char *hdr;
+  int hlen, hoff;
+  struct frame *frame;
+  int foff;
+  unsigned int seq;
+  int close_after;
+  int keep_alive;
+  int served;
+  int viewing;
+  /* the client has shut down its side, answer what it asked and close */
+  int eof;
+  struct http_conn *prev, *next;
+};
+
+struct http_event_loop {
+  struct http_server *srv;
+  int epfd;
+  struct ring_consumer consumer;
+  /* wakes the loop for new live frames and for more data of them */
+  struct ring_consumer live;
+  struct http_conn *conns;
+  pthread_t thread;
+};
+
 static void http_header_free(struct http_header *header);
+static int conn_request(struct http_event_loop *loop, struct http_conn *c);
 
-static int print_picture(int fd, unsigned char *buf, int size)
+/* live pictures come in pieces, only the first one starts with SOI */
+static void check_picture(unsigned char *buf, int size)
 {
-  int jpg_hdr = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
-  if(jpg_hdr != 0xFFD8FFE0 && jpg_hdr != 0xFFD8FFC0) {
+  int jpg_hdr;
+
+  if (size >= 4) {
+    jpg_hdr = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+    if(jpg_hdr != 0xFFD8FFE0 && jpg_hdr != 0xFFD8FFC0) {
       printf("%s: invalid JPEG header 0x%X\n", __func__, jpg_hdr);
+    }
+  }
+}
+
+/* send header and picture with as few syscalls as possible */
+static int print_picture(int fd, const char *hdr, int hlen, unsigned char *buf, int size)
+{
+  struct iovec iov[2];
+  int n, cnt;
+
+  /* an empty picture still gets its header */
+  while (hlen > 0 || size > 0) {
+    cnt = 0;
+    if (hlen > 0) {
+      iov[cnt].iov_base = (void *)hdr;
+      iov[cnt].iov_len = hlen;
+      cnt++;
+    }
+    if (size > 0) {
+      iov[cnt].iov_base = buf;
+      iov[cnt].iov_len = size;
+      cnt++;
+    }
+
+    n = writev(fd, iov, cnt);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    if (n < hlen) {
+      hdr += n;
+      hlen -= n;
+      continue;
+    }
+    n -= hlen;
+    hlen = 0;
+    buf += n;
+    size -= n;
   }
-  if( write(fd, buf, size) <= 0) return -1;
   return 0;
 }
 
@@ -155,39 +282,6 @@ static int data_available(int socket, int timeout)
   return select(socket+1, &fds, NULL, NULL, &to);
 }
 
-static int http_header_readline(int fd, char *buf, int len)
-{
-  char *ptr = buf;
-  char *ptr_end = ptr + len - 1;
-
-  if(data_available(fd, READ_TIMEOUT) <= 0) {
-    return -1;
-  }
-
-  while (ptr < ptr_end) {
-    switch (read(fd, ptr, 1)) {
-    case 1:
-      if (*ptr == '\r')
-        continue;
-      else if (*ptr == '\n') {
-        *ptr = '\0';
-        return ptr - buf;
-      } else {
-        ptr++;
-        continue;
-      }
-    case 0:
-      *ptr = '\0';
-      return ptr - buf;
-    default:
-      printf("%s() failed: %s\n", __func__, strerror(errno));
-      return -1;
-    }
-  }
-
-  return len;
-}
-
 static int http_parse_headers(struct http_header *header, const char *hdr_line)
 {
   char *p;
@@ -203,59 +297,259 @@ static int http_parse_headers(struct http_header *header, const char *hdr_line)
     header_content++;
   } while (*header_content == ' ');
 
-  if(!strcmp("Authorization", header_name)){
+  if(!strcasecmp("Authorization", header_name)){
     header->auth = strdup(header_content);
   }
+  else if(!strcasecmp("If-None-Match", header_name)){
+    header->etag = strdup(header_content);
+  }
+  else if(!strcasecmp("Range", header_name)){
+    header->range = strdup(header_content);
+  }
+  else if(!strcasecmp("Connection", header_name)){
+    header->connection = strdup(header_content);
+  }
 
   *p = ':';
   return 0;
 }
 
-static int http_parse_header(struct clientArgs *client, struct http_header *header)
+static void http_header_init(struct clientArgs *client, struct http_header *header)
 {
-  char header_line[BUFF_MAX];
-  char *token = NULL;
-  int res, count =0;
-
-  header->method= NULL;
-  header->uri = NULL;
-  header->auth = NULL;
+  memset(header, 0, sizeof(struct http_header));
 
   client->auth_state = AUTH_NONE;
   client->request_type = UNKNOWN;
+  client->fresh = 0;
+  client->live = 0;
+  client->period = 0;
+  client->due = 0;
+}
 
-  /* fcntl(socketfd, F_SETFL, fcntl(socketfd, F_GETFL, 0) | O_NONBLOCK);*/
-  while ((res = http_header_readline( client->socket, header_line, sizeof(header_line))) > 0) {
-    if (!count) {
-      token = strtok(header_line, " ");
-      if(token) {
-        header->method = strdup(token);
-      }
-      token = strtok(NULL, " ");
-      if(token) {
-        header->uri = strdup(token);
-      }
+/* the first line is the request line, the others are headers */
+static void http_parse_line(struct http_header *header, char *header_line, int count)
+{
+  char *token = NULL;
 
-    } else {
-      http_parse_headers(header, header_line);
+  if (!count) {
+    token = strtok(header_line, " ");
+    if(token) {
+      header->method = strdup(token);
+    }
+    token = strtok(NULL, " ");
+    if(token) {
+      header->uri = strdup(token);
+    }
+    token = strtok(NULL, " ");
+    if(token) {
+      header->http11 = !strcmp(token, "HTTP/1.1");
+    }
+
+  } else {
+    http_parse_headers(header, header_line);
+  }
+}
+
+/* compare the path of an uri, ignoring the query string */
+static int http_uri_is(const char *uri, const char *path)
+{
+  size_t len = strcspn(uri, "?");
+  return len == strlen(path) && !strncmp(uri, path, len);
+}
+
+/*
+ * Copy the value of key from the query string of uri, "&" separates the
+ * pairs and keys are compared whole. Returns the length of the value or -1
+ * if the key is not there.
+ */
+static int http_query(const char *uri, const char *key, char *value, int size)
+{
+  const char *p = strchr(uri, '?');
+  size_t len = strlen(key), n;
+
+  while (p != NULL) {
+    p++;
+    n = strcspn(p, "&=");
+    if (n == len && !strncmp(p, key, len)) {
+      p += n;
+      n = (*p == '=') ? strcspn(++p, "&") : 0;
+      if (n > (size_t)size - 1) {
+        n = size - 1;
+      }
+      memcpy(value, p, n);
+      value[n] = '\0';
+      return n;
     }
-    count++;
+    p = strchr(p, '&');
   }
+  return -1;
+}
+
+/* a flag is on when its value is "1" */
+static int http_query_flag(const char *uri, const char *key)
+{
+  char value[4];
+
+  return http_query(uri, key, value, sizeof(value)) == 1 && value[0] == '1';
+}
+
+static void http_request_type(struct clientArgs *client, struct http_header *header)
+{
+  double fps, max_fps = client->server->max_fps;
+  char value[32], *end;
 
   if (header->uri) {
-    if (!strcmp(header->uri, SNAPSHOT_URI)) {
+    if (http_uri_is(header->uri, SNAPSHOT_URI)) {
       client->request_type = SNAPSHOT;
     }
-    if (!strcmp(header->uri, STREAM_URI)) {
+    if (http_uri_is(header->uri, STREAM_URI)) {
       client->request_type = STREAM;
     }
+    if (http_uri_is(header->uri, METRICS_URI)) {
+      client->request_type = METRICS;
+    }
+    if (http_uri_is(header->uri, LATENCY_URI)) {
+      client->request_type = LATENCY;
+    }
+    /* ?fresh=1 waits for the next frame instead of serving the latest one */
+    if (http_query_flag(header->uri, "fresh")) {
+      client->fresh = 1;
+    }
+    /* ?live=1 streams each picture while it is being encoded */
+    if (http_query_flag(header->uri, "live") && client->request_type == STREAM &&
+        client->server->live) {
+      client->live = 1;
+    }
+    /*
+     * ?fps=N paces the stream, the server may have a lower cap. What is not
+     * a number of 0 or more counts as not given.
+     */
+    if (client->request_type == STREAM) {
+      fps = 0;
+      if (http_query(header->uri, "fps", value, sizeof(value)) > 0) {
+        fps = strtod(value, &end);
+        if (*end != '\0' || !(fps >= 0)) {
+          fps = 0;
+        }
+        /* the period has to fit into 64 bits of ns */
+        if (fps > 0 && fps < FPS_MIN) {
+          fps = FPS_MIN;
+        }
+      }
+      if (max_fps > 0 && (fps <= 0 || fps > max_fps)) {
+        fps = max_fps;
+      }
+      client->period = (fps > 0) ? (uint64_t)(1e9 / fps) : 0;
+    }
   } else {
     client->request_type= INVALID;
   }
 
+  /* HTTP/1.1 connections are persistent unless the client says otherwise */
+  if (header->connection) {
+    header->keep_alive = (strcasestr(header->connection, "keep-alive") != NULL);
+    if (strcasestr(header->connection, "close")) {
+      header->keep_alive = 0;
+    }
+  } else {
+    header->keep_alive = header->http11;
+  }
+
   if (client->server->password) {
     client->auth_state = (header->auth == NULL) ? AUTH_PENDING : AUTH_CHECK;
   }
+}
+
+static void http_rbuf_consume(struct http_rbuf *rb, int len)
+{
+  memmove(rb->data, rb->data + len, rb->len - len);
+  rb->len -= len;
+  rb->scan = 0;
+}
+
+/*
+ * Incremental HTTP/1.x request parser. Returns 1 and fills header once a
+ * complete request header is buffered, 0 if more data is needed and -1 if
+ * the header does not fit into the buffer. The parsed request is consumed,
+ * pipelined requests behind it stay in the buffer for the next call.
+ */
+static int http_parse_request(struct http_rbuf *rb, struct clientArgs *client,
+                              struct http_header *header)
+{
+  char *p, *prev, *line, *end = NULL;
+  int skip = 0, count = 0;
+
+  http_header_init(client, header);
+
+  /* empty lines in front of a request are ignored */
+  while (skip < rb->len && (rb->data[skip] == '\r' || rb->data[skip] == '\n')) {
+    skip++;
+  }
+  if (skip) {
+    http_rbuf_consume(rb, skip);
+  }
+
+  /* find the empty line that ends the header, only look at new data */
+  for (p = rb->data + rb->scan; p < rb->data + rb->len; p++) {
+    if (*p != '\n') {
+      continue;
+    }
+    prev = p - 1;
+    if (prev > rb->data && *prev == '\r') {
+      prev--;
+    }
+    if (prev >= rb->data && *prev == '\n') {
+      end = p + 1;
+      break;
+    }
+  }
+
+  if (end == NULL) {
+    rb->scan = rb->len;
+    return (rb->len >= RBUF_MAX) ? -1 : 0;
+  }
+
+  /* split the header into lines in a single pass */
+  for (line = p = rb->data; p < end; p++) {
+    if (*p != '\n') {
+      continue;
+    }
+    *p = '\0';
+    if (p > line && p[-1] == '\r') {
+      p[-1] = '\0';
+    }
+    if (*line) {
+      http_parse_line(header, line, count);
+      count++;
+    }
+    line = p + 1;
+  }
+
+  http_rbuf_consume(rb, end - rb->data);
+  http_request_type(client, header);
+  return 1;
+}
+
+/* read from a blocking socket until a complete request header is buffered */
+static int http_read_request(struct clientArgs *client, struct http_rbuf *rb,
+                             struct http_header *header)
+{
+  int res, n;
+
+  while ((res = http_parse_request(rb, client, header)) == 0) {
+    if(data_available(client->socket, READ_TIMEOUT) <= 0) {
+      return -1;
+    }
+
+    n = read(client->socket, rb->data + rb->len, RBUF_MAX - rb->len);
+    if (n <= 0) {
+      if (n < 0) {
+        printf("%s() failed: %s\n", __func__, strerror(errno));
+      }
+      return -1;
+    }
+    rb->len += n;
+  }
 
   return res;
 }
@@ -273,6 +567,18 @@ static void http_header_free(struct http_header *header)
   if(header->auth){
     free(header->auth);
   }
+
+  if(header->etag){
+    free(header->etag);
+  }
+
+  if(header->range){
+    free(header->range);
+  }
+
+  if(header->connection){
+    free(header->connection);
+  }
 }
 
 void http_digest_init(struct http_digest_auth *auth)
@@ -299,55 +605,47 @@ int http_digest_responce(struct clientArgs *client,
   return (strstr(hdr->auth, response_hash) != NULL);
 }
 
-/* thread for clients that connected to this server */
-static void *http_client_thread( void *arg )
+/*
+ * Fill buffer with the response header for the parsed request, returns 1 if
+ * the connection is to be closed once it has been sent.
+ */
+static int http_response(struct clientArgs *ca, struct http_header *header,
+                         char *buffer, int size)
 {
-  struct clientArgs *ca = (struct clientArgs *)arg;
-  struct thread_buff *tbuff = ca->server->ptbuff;
-  int ok = 1, should_close_connection = 0;
-  char buffer[BUFF_MAX] = {0};
-  struct buff *b = NULL;
-  struct http_header header;
+  int should_close_connection = 0;
   struct http_digest_auth digest_auth;
 
   http_digest_init(&digest_auth);
-  pthread_detach(pthread_self());
-
-  if(http_parse_header(ca, &header) < 0){
-    close(ca->socket);
-    http_header_free(&header);
-    free(arg);
-    return NULL;
-  }
-
-  printf("thread_id: %ld request %s\n", pthread_self(), header.uri);
 
   switch (ca->request_type) {
     case SNAPSHOT:
-      snprintf(buffer, sizeof(buffer), SNAPSHOT_HEADER);
+    case METRICS:
+    case LATENCY:
+      /* sent together with the picture, see http_frame_header() */
+      buffer[0] = '\0';
     break;
     case STREAM:
-      snprintf(buffer, sizeof(buffer), STREAM_HEADER);
+      snprintf(buffer, size, STREAM_HEADER);
     break;
     case INVALID:
-      snprintf(buffer, sizeof(buffer), "%s", bad_request_response);
+      snprintf(buffer, size, "%s", bad_request_response);
       should_close_connection = 1;
     break;
     default:
-      snprintf(buffer, sizeof(buffer), not_found_request_response, header.uri);
+      snprintf(buffer, size, not_found_request_response, header->uri);
       should_close_connection = 1;
     break;
   }
 
   switch (ca->auth_state) {
     case AUTH_PENDING:
-      snprintf(buffer, sizeof(buffer), AUTH_HEADER,
+      snprintf(buffer, size, AUTH_HEADER,
               digest_auth.realm, digest_auth.nonce, digest_auth.opaque);
       should_close_connection = 1;
     break;
     case AUTH_CHECK:
-      if(!http_digest_responce(ca, &digest_auth, &header)) {
-        snprintf(buffer, sizeof(buffer), "%s", unautorized_request_response);
+      if(!http_digest_responce(ca, &digest_auth, header)) {
+        snprintf(buffer, size, "%s", unautorized_request_response);
         should_close_connection = 1;
       }
     break;
@@ -355,46 +653,926 @@ static void *http_client_thread( void *arg )
     break;
   }
 
-  ok = ( write(ca->socket, buffer, strlen(buffer)) >= 0)?1:0;
+  return should_close_connection;
+}
+
+/*
+ * Build the multipart header of a frame. Called once by the camera thread
+ * before the frame is published, all streaming clients share it.
+ */
+void http_frame_part(struct frame *f)
+{
+  f->partlen = snprintf(f->part, sizeof(f->part), STREAM_HEADER_CHUNK, f->size,
+                        (long)f->timestamp.tv_sec, (long)f->timestamp.tv_usec);
+}
+
+/*
+ * Counters and latencies are text reports made for each request. They are
+ * not viewers, the camera may stay off for them.
+ */
+static int http_is_report(struct clientArgs *ca)
+{
+  return ca->request_type == METRICS || ca->request_type == LATENCY;
+}
+
+static struct frame *http_report(struct clientArgs *ca)
+{
+  return (ca->request_type == METRICS) ? metrics_frame() : metrics_latency_frame();
+}
+
+/* header in front of every picture: multipart boundary, snapshot or metrics response */
+static const char *http_frame_header(struct clientArgs *ca, struct frame *f, int keep_alive,
+                                     char *buffer, int size, int *len)
+{
+  if (ca->request_type == STREAM && ca->live) {
+    *len = snprintf(buffer, size, LIVE_HEADER_CHUNK, (long)f->timestamp.tv_sec,
+                    (long)f->timestamp.tv_usec);
+    return buffer;
+  }
+  if (ca->request_type == STREAM) {
+    *len = f->partlen;
+    return f->part;
+  }
+  if (http_is_report(ca)) {
+    *len = snprintf(buffer, size, REPORT_HEADER,
+                    (ca->request_type == METRICS) ? "; version=0.0.4" : "", f->size,
+                    keep_alive ? "keep-alive" : "close");
+    return buffer;
+  }
+  *len = snprintf(buffer, size, SNAPSHOT_HEADER, f->size, (long)f->timestamp.tv_sec,
+                  (long)f->timestamp.tv_usec, keep_alive ? "keep-alive" : "close");
+  return buffer;
+}
+
+/* bytes of f that can be sent, live frames grow while they are encoded */
+static int frame_avail(struct clientArgs *ca, struct frame *f)
+{
+  if (ca->live) {
+    return __atomic_load_n(&f->ready, __ATOMIC_ACQUIRE);
+  }
+  return f->size;
+}
+
+/*
+ * A live picture that failed to encode after part of it was sent, the part
+ * cannot be finished. Check after frame_done().
+ */
+static int frame_aborted(struct clientArgs *ca, struct frame *f, int sent)
+{
+  return ca->live && f->size <= 0 && sent > 0;
+}
+
+/* a live frame is complete, check before frame_avail() */
+static int frame_done(struct clientArgs *ca, struct frame *f)
+{
+  return !ca->live || __atomic_load_n(&f->done, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * A paced stream took a picture at "now", the next one is due a period
+ * later. A client that fell behind starts over from now instead of
+ * catching up, it gets the latest picture either way.
+ */
+static void http_pace(struct clientArgs *ca, uint64_t now)
+{
+  if (ca->period == 0) {
+    return;
+  }
+  if (ca->due && now < ca->due + ca->period) {
+    ca->due += ca->period;
+  } else {
+    ca->due = now + ca->period;
+  }
+}
+
+/* client threads sleep until the next picture of a paced stream is due */
+static void http_pace_wait(struct clientArgs *ca)
+{
+  struct timespec ts;
+
+  if (ca->period == 0 || ca->due <= frame_clock()) {
+    return;
+  }
+  ts.tv_sec = ca->due / 1000000000ULL;
+  ts.tv_nsec = ca->due % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stop);
+}
+
+/*
+ * Live stream of a client thread: every picture of the live ring is sent
+ * piece by piece as the encoder makes it ready, in a part without length.
+ */
+static int http_send_live(struct clientArgs *ca, char *buffer, int size)
+{
+  struct frame_ring *ring = ca->server->live;
+  struct ring_consumer consumer;
+  struct frame *f;
+  const char *hdr;
+  unsigned int seq;
+  int hlen, sent, ready, done, ok = 0;
+
+  if (ring_attach(ring, &consumer) < 0) {
+    return -1;
+  }
+  ring_viewers_add(ring, 1);
 
-  if (should_close_connection) {
+  while (ok >= 0 && !stop) {
+    http_pace_wait(ca);
+    seq = consumer.seq;
+    if ((f = ring_wait(ring, &consumer)) == NULL) {
+      break;
+    }
+    http_pace(ca, frame_clock());
+    if (consumer.seq - seq > 1) {
+      metrics_skipped(ca->stats, consumer.seq - seq - 1);
+    }
+    hdr = http_frame_header(ca, f, 0, buffer, size, &hlen);
+
+    for (sent = 0; ok >= 0; ) {
+      done = frame_done(ca, f);
+      ready = frame_avail(ca, f);
+      if (ready > sent) {
+        if (hlen > 0) {
+          check_picture(f->buff, ready);
+        }
+        ok = print_picture(ca->socket, hdr, hlen, f->buff + sent, ready - sent);
+        if (ok >= 0) {
+          metrics_sent(ca->stats, hlen + ready - sent, 0);
+        }
+        hlen = 0;
+        sent = ready;
+      }
+      else if (done) {
+        if (frame_aborted(ca, f, sent)) {
+          ok = -1;
+          break;
+        }
+        metrics_sent(ca->stats, 0, 1);
+        metrics_frame_sent(f);
+        break;
+      }
+      else if (ring_wait_data(ring, &consumer, f, sent) < 0) {
+        ok = -1;
+      }
+    }
+    frame_unref(f);
+  }
+
+  ring_viewers_add(ring, -1);
+  ring_detach(ring, &consumer);
+  return ok;
+}
+
+/* thread for clients that connected to this server */
+static void *http_client_thread( void *arg )
+{
+  struct clientArgs *ca = (struct clientArgs *)arg;
+  struct frame_ring *ring = ca->server->ring;
+  struct ring_consumer consumer;
+  struct http_rbuf rbuf;
+  int ok = 0, keep_alive = 1, should_close_connection = 0;
+  char buffer[BUFF_MAX] = {0};
+  const char *hdr;
+  int hlen;
+  struct frame *f = NULL;
+  struct http_header header;
+
+  unsigned int seq;
+
+  pthread_detach(pthread_self());
+  rbuf.len = rbuf.scan = 0;
+
+  if (ring_attach(ring, &consumer) < 0) {
     close(ca->socket);
-    http_header_free(&header);
     free(arg);
     return NULL;
   }
+  ca->stats = metrics_client_open(&ca->client_addr);
 
-  /* mjpeg server push */
-  while (ok >= 0 && !stop) {
+  /* persistent connections may ask for one snapshot after the other */
+  while (keep_alive && ok >= 0 && !stop) {
 
-    pthread_mutex_lock(&(tbuff)->lock);
-    pthread_cond_wait(&(tbuff)->cond, &(tbuff)->lock);
+    if(http_read_request(ca, &rbuf, &header) <= 0){
+      http_header_free(&header);
+      break;
+    }
 
-    b = queue_front(&(tbuff)->qbuff);
+    printf("thread_id: %ld request %s\n", pthread_self(), header.uri);
 
-    if (ca->request_type == STREAM) {
-      snprintf(buffer,sizeof(buffer), STREAM_HEADER_CHUNK);
+    should_close_connection = http_response(ca, &header, buffer, sizeof(buffer));
+    keep_alive = header.keep_alive && (ca->request_type == SNAPSHOT || http_is_report(ca));
+    http_header_free(&header);
 
-      if(write(ca->socket, buffer, strlen(buffer)) < 0) {
-        pthread_mutex_unlock( &(tbuff)->lock );
+    if (buffer[0]) {
+      hlen = strlen(buffer);
+      ok = ( write(ca->socket, buffer, hlen) >= 0)?0:-1;
+      if (ok == 0) {
+        metrics_sent(ca->stats, hlen, 0);
+      }
+    }
+
+    if (should_close_connection) {
+      break;
+    }
+
+    if (http_is_report(ca)) {
+      f = http_report(ca);
+      if (f == NULL) {
         break;
       }
+      hdr = http_frame_header(ca, f, keep_alive, buffer, sizeof(buffer), &hlen);
+      ok = print_picture(ca->socket, hdr, hlen, f->buff, f->size);
+      if (ok == 0) {
+        metrics_sent(ca->stats, hlen + f->size, 0);
+      }
+      frame_unref(f);
+      continue;
     }
 
-    ok = print_picture(ca->socket, b->buff, b->size);
-    pthread_mutex_unlock( &(tbuff)->lock );
+    /* mjpeg server push, only frames published from now on are sent */
+    consumer.seq = ring_head(ring);
+    ring_viewers_add(ring, 1);
 
-    if(ca->request_type != STREAM) {
-      break;
+    if (ca->request_type == STREAM && ca->live) {
+      ok = http_send_live(ca, buffer, sizeof(buffer));
     }
+
+    while (ok >= 0 && !stop && !ca->live) {
+
+      /* snapshots get the latest frame right away unless asked for a fresh one */
+      f = NULL;
+      if (ca->request_type == SNAPSHOT && !ca->fresh && !ring_stale(ring)) {
+        f = ring_latest(ring, NULL);
+      }
+      if (f == NULL) {
+        http_pace_wait(ca);
+        seq = consumer.seq;
+        f = ring_wait(ring, &consumer);
+        if (f && ca->request_type == STREAM && consumer.seq - seq > 1) {
+          metrics_skipped(ca->stats, consumer.seq - seq - 1);
+        }
+        http_pace(ca, frame_clock());
+      }
+      if (f == NULL) {
+        ok = -1;
+        break;
+      }
+
+      hdr = http_frame_header(ca, f, keep_alive, buffer, sizeof(buffer), &hlen);
+      check_picture(f->buff, f->size);
+      ok = print_picture(ca->socket, hdr, hlen, f->buff, f->size);
+      if (ok == 0) {
+        metrics_sent(ca->stats, hlen + f->size, 1);
+        if (ca->request_type == STREAM) {
+          metrics_frame_sent(f);
+        }
+      }
+      frame_unref(f);
+
+      if(ca->request_type != STREAM) {
+        break;
+      }
+    }
+    ring_viewers_add(ring, -1);
   }
 
+  ring_detach(ring, &consumer);
+  metrics_client_close(ca->stats);
+
   close(ca->socket);
-  http_header_free(&header);
   free(arg);
   return NULL;
 }
 
+/* live streams take their frames from the live ring */
+static struct frame_ring *conn_ring(struct http_event_loop *loop, struct http_conn *c)
+{
+  return c->ca.live ? loop->srv->live : loop->srv->ring;
+}
+
+/*
+ * Count the connection as a viewer while it waits for or gets frames. Live
+ * viewers count on both rings, the camera has to run for them too.
+ */
+static void conn_view(struct http_event_loop *loop, struct http_conn *c, int on)
+{
+  if (c->viewing != on) {
+    ring_viewers_add(loop->srv->ring, on ? 1 : -1);
+    if (c->ca.live) {
+      ring_viewers_add(loop->srv->live, on ? 1 : -1);
+    }
+    c->viewing = on;
+  }
+}
+
+static void conn_close(struct http_event_loop *loop, struct http_conn *c)
+{
+  conn_view(loop, c, 0);
+  metrics_client_close(c->ca.stats);
+  close(c->ca.socket);
+  frame_unref(c->frame);
+  free(c->rbuf);
+
+  if (c->prev) {
+    c->prev->next = c->next;
+  } else {
+    loop->conns = c->next;
+  }
+  if (c->next) {
+    c->next->prev = c->prev;
+  }
+  free(c);
+}
+
+static int conn_events(struct http_event_loop *loop, struct http_conn *c, int events)
+{
+  struct epoll_event ev;
+
+  /* nothing more to read after EOF, or until a buffered request is taken */
+  if (c->eof || (c->rbuf && c->rbuf->len == RBUF_MAX)) {
+    events &= ~EPOLLIN;
+  }
+  if (c->events == events) {
+    return 0;
+  }
+  ev.events = events;
+  ev.data.ptr = c;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->ca.socket, &ev) < 0) {
+    perror("epoll_ctl");
+    return -1;
+  }
+  c->events = events;
+  return 0;
+}
+
+/* queue frame f (the reference is taken over) behind the part header */
+static void conn_load_frame(struct http_conn *c, struct frame *f, unsigned int seq)
+{
+  if (c->ca.request_type == STREAM) {
+    if (seq - c->seq > 1) {
+      metrics_skipped(c->ca.stats, seq - c->seq - 1);
+    }
+    http_pace(&c->ca, frame_clock());
+  }
+  c->frame = f;
+  c->foff = 0;
+  c->seq = seq;
+  c->hoff = 0;
+  c->hdr = http_frame_header(&c->ca, f, c->keep_alive, c->hbuf, sizeof(c->hbuf), &c->hlen);
+  if (c->ca.request_type != STREAM) {
+    c->close_after = !c->keep_alive;
+    c->served = 1;
+  }
+  c->state = CONN_SEND;
+}
+
+/*
+ * Write header and picture with one writev() as far as the socket takes
+ * them, returns 1 when done, 0 if it would block.
+ */
+static int conn_write(struct http_conn *c)
+{
+  struct iovec iov[2];
+  int n, cnt, avail;
+
+  for (;;) {
+    cnt = 0;
+    if (c->hoff < c->hlen) {
+      iov[cnt].iov_base = (void *)(c->hdr + c->hoff);
+      iov[cnt].iov_len = c->hlen - c->hoff;
+      cnt++;
+    }
+    if (c->frame && c->foff < (avail = frame_avail(&c->ca, c->frame))) {
+      iov[cnt].iov_base = c->frame->buff + c->foff;
+      iov[cnt].iov_len = avail - c->foff;
+      cnt++;
+    }
+    if (!cnt) {
+      return 1;
+    }
+
+    n = writev(c->ca.socket, iov, cnt);
+    if (n < 0) {
+      return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    metrics_sent(c->ca.stats, n, 0);
+
+    if (n > c->hlen - c->hoff) {
+      c->foff += n - (c->hlen - c->hoff);
+      c->hoff = c->hlen;
+    } else {
+      c->hoff += n;
+    }
+  }
+}
+
+/*
+ * Send pending output, then move on to the latest frame if the client has
+ * not seen it yet. Returns -1 if the connection is to be closed.
+ */
+static int conn_flush(struct http_event_loop *loop, struct http_conn *c)
+{
+  struct frame_ring *ring = conn_ring(loop, c);
+  struct frame *f;
+  unsigned int seq;
+  int res, done;
+
+  for (;;) {
+    done = c->frame == NULL || frame_done(&c->ca, c->frame);
+    res = conn_write(c);
+    if (res < 0) {
+      return -1;
+    }
+    if (res == 0) {
+      c->state = CONN_SEND;
+      return conn_events(loop, c, EPOLLOUT);
+    }
+
+    /* all of a live picture there is has been sent, wait for more */
+    if (!done) {
+      c->state = CONN_WAIT_DATA;
+      return conn_events(loop, c, EPOLLIN);
+    }
+    /* closing is the only way to end a part with half a picture in it */
+    if (c->frame && frame_aborted(&c->ca, c->frame, c->foff)) {
+      return -1;
+    }
+
+    if (c->frame && !http_is_report(&c->ca)) {
+      metrics_sent(c->ca.stats, 0, 1);
+      if (c->ca.request_type == STREAM) {
+        metrics_frame_sent(c->frame);
+      }
+    }
+    frame_unref(c->frame);
+    c->frame = NULL;
+
+    if (c->close_after) {
+      return -1;
+    }
+
+    /* snapshot delivered on a persistent connection, go on with the next request */
+    if (c->served) {
+      c->served = 0;
+      conn_view(loop, c, 0);
+      c->state = CONN_READ;
+      c->since = time(NULL);
+      if (conn_events(loop, c, EPOLLIN) < 0) {
+        return -1;
+      }
+      res = c->rbuf ? conn_request(loop, c) : 0;
+      /* no complete request left from a client that is done sending */
+      return (c->state == CONN_READ && c->eof) ? -1 : res;
+    }
+
+    /* paced streams wait for their time, then take the latest picture */
+    if (c->ca.period && c->ca.due > frame_clock()) {
+      c->state = CONN_PACE;
+      return conn_events(loop, c, EPOLLIN);
+    }
+
+    if (ring_head(ring) == c->seq || (f = ring_latest(ring, &seq)) == NULL) {
+      c->state = CONN_WAIT_FRAME;
+      return conn_events(loop, c, EPOLLIN);
+    }
+    conn_load_frame(c, f, seq);
+  }
+}
+
+/* answer the next request buffered for this connection */
+static int conn_request(struct http_event_loop *loop, struct http_conn *c)
+{
+  struct http_header header;
+  struct frame *f;
+  unsigned int seq;
+  int res;
+
+  res = http_parse_request(c->rbuf, &c->ca, &header);
+  if (res <= 0) {
+    return res;
+  }
+
+  printf("fd: %d request %s\n", c->ca.socket, header.uri);
+
+  c->close_after = http_response(&c->ca, &header, c->hbuf, sizeof(c->hbuf));
+  c->keep_alive = header.keep_alive && (c->ca.request_type == SNAPSHOT || http_is_report(&c->ca));
+  c->hdr = c->hbuf;
+  c->hlen = strlen(c->hbuf);
+  c->hoff = 0;
+  http_header_free(&header);
+
+  /* keep the receive buffer only while it holds pipelined data */
+  if (c->rbuf->len == 0) {
+    free(c->rbuf);
+    c->rbuf = NULL;
+  }
+
+  /* streams and fresh snapshots wait for a frame newer than the request */
+  c->seq = ring_head(conn_ring(loop, c));
+  c->state = CONN_SEND;
+
+  if (http_is_report(&c->ca) && !c->close_after) {
+    f = http_report(&c->ca);
+    if (f) {
+      conn_load_frame(c, f, 0);
+    } else {
+      c->close_after = 1;
+    }
+    return conn_flush(loop, c);
+  }
+
+  if (!c->close_after) {
+    conn_view(loop, c, 1);
+  }
+
+  if (c->ca.request_type == SNAPSHOT && !c->ca.fresh && !c->close_after &&
+      !ring_stale(loop->srv->ring)) {
+    f = ring_latest(loop->srv->ring, &seq);
+    if (f) {
+      conn_load_frame(c, f, seq);
+    }
+  }
+  return conn_flush(loop, c);
+}
+
+/* read what the client sent into the receive buffer, -1 on errors */
+static int conn_fill(struct http_conn *c)
+{
+  struct http_rbuf *rb;
+  int n;
+
+  if (c->rbuf == NULL) {
+    c->rbuf = malloc(sizeof(struct http_rbuf));
+    if (c->rbuf == NULL) {
+      return -1;
+    }
+    c->rbuf->len = c->rbuf->scan = 0;
+  }
+  rb = c->rbuf;
+
+  n = read(c->ca.socket, rb->data + rb->len, RBUF_MAX - rb->len);
+  if (n == 0) {
+    c->eof = 1;
+    return 0;
+  }
+  if (n < 0) {
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+  }
+  rb->len += n;
+  return 0;
+}
+
+static int conn_read(struct http_event_loop *loop, struct http_conn *c)
+{
+  if (conn_fill(c) < 0 || c->eof) {
+    return -1;
+  }
+  return conn_request(loop, c);
+}
+
+/*
+ * Input while the client is being served. A persistent connection keeps it
+ * for the request after this one, for a stream it has no meaning.
+ */
+static int conn_input(struct http_event_loop *loop, struct http_conn *c)
+{
+  if (conn_fill(c) < 0) {
+    return -1;
+  }
+  if (c->eof && c->ca.request_type == STREAM) {
+    return -1;
+  }
+  if (!c->keep_alive && c->rbuf) {
+    c->rbuf->len = c->rbuf->scan = 0;
+  }
+  return conn_events(loop, c, EPOLLIN);
+}
+
+static void conn_event(struct http_event_loop *loop, struct http_conn *c, int events)
+{
+  int res = 0;
+
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    res = -1;
+  }
+  else if (c->state == CONN_READ) {
+    res = conn_read(loop, c);
+  }
+  else if (c->state == CONN_SEND && (events & EPOLLOUT)) {
+    res = conn_flush(loop, c);
+  }
+  else if (events & EPOLLIN) {
+    res = conn_input(loop, c);
+  }
+
+  if (res < 0) {
+    conn_close(loop, c);
+  }
+}
+
+static void http_event_accept(struct http_event_loop *loop)
+{
+  struct http_conn *c;
+  struct sockaddr_in addr;
+  socklen_t len;
+  struct epoll_event ev;
+  int fd;
+
+  for (;;) {
+    len = sizeof(addr);
+    fd = accept4(loop->srv->sd, (struct sockaddr *)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("accept failed");
+      }
+      return;
+    }
+
+    c = calloc(1, sizeof(struct http_conn));
+    if (c == NULL) {
+      close(fd);
+      continue;
+    }
+    c->ca.socket = fd;
+    c->ca.client_addr = addr;
+    c->ca.server = loop->srv;
+    c->state = CONN_READ;
+    c->events = EPOLLIN;
+    c->since = time(NULL);
+
+    ev.events = c->events;
+    ev.data.ptr = c;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      perror("epoll_ctl");
+      close(fd);
+      free(c);
+      continue;
+    }
+    c->ca.stats = metrics_client_open(&addr);
+
+    c->next = loop->conns;
+    if (loop->conns) {
+      loop->conns->prev = c;
+    }
+    loop->conns = c;
+  }
+}
+
+/* hand the latest frame of ring to every connection waiting for one */
+static void http_event_dispatch(struct http_event_loop *loop, struct frame_ring *ring,
+                                struct ring_consumer *consumer)
+{
+  struct http_conn *c, *next;
+  struct frame *f;
+  unsigned int seq;
+
+  f = ring_latest(ring, &seq);
+  if (f == NULL) {
+    return;
+  }
+  consumer->seq = seq;
+
+  for (c = loop->conns; c; c = next) {
+    next = c->next;
+    if (c->state == CONN_WAIT_FRAME && conn_ring(loop, c) == ring && c->seq != seq) {
+      conn_load_frame(c, frame_ref(f), seq);
+      if (conn_flush(loop, c) < 0) {
+        conn_close(loop, c);
+      }
+    }
+  }
+  frame_unref(f);
+}
+
+/* go on with live streams that have more of their picture ready */
+static void http_event_live(struct http_event_loop *loop)
+{
+  struct frame_ring *live = loop->srv->live;
+  struct http_conn *c, *next;
+
+  for (c = loop->conns; c; c = next) {
+    next = c->next;
+    if (c->state == CONN_WAIT_DATA &&
+        ring_arm_data(live, &loop->live, c->frame, c->foff) &&
+        conn_flush(loop, c) < 0) {
+      conn_close(loop, c);
+    }
+  }
+}
+
+/*
+ * Request wakeups for the live ring, returns 1 if there is something to
+ * do for it already: a new live frame or more data of one being sent.
+ */
+static int http_event_live_arm(struct http_event_loop *loop)
+{
+  struct frame_ring *live = loop->srv->live;
+  struct http_conn *c;
+
+  if (live == NULL || ring_viewers(live) == 0) {
+    return 0;
+  }
+  for (c = loop->conns; c; c = c->next) {
+    if (c->state == CONN_WAIT_DATA && ring_arm_data(live, &loop->live, c->frame, c->foff)) {
+      return 1;
+    }
+  }
+  return ring_arm(live, &loop->live);
+}
+
+/*
+ * Go on with paced streams that are due, returns the milliseconds until
+ * the next one is, at most a second.
+ */
+static int http_event_pace(struct http_event_loop *loop)
+{
+  struct http_conn *c, *next;
+  uint64_t now = frame_clock(), wake = now + 1000000000ULL;
+
+  for (c = loop->conns; c; c = next) {
+    next = c->next;
+    if (c->state != CONN_PACE) {
+      continue;
+    }
+    if (c->ca.due <= now && conn_flush(loop, c) < 0) {
+      conn_close(loop, c);
+      continue;
+    }
+    if (c->state == CONN_PACE && c->ca.due < wake) {
+      wake = c->ca.due;
+    }
+  }
+  return (wake - now + 999999) / 1000000;
+}
+
+/* drop clients that did not send their request in time */
+static void http_event_timeout(struct http_event_loop *loop, time_t now)
+{
+  struct http_conn *c, *next;
+
+  for (c = loop->conns; c; c = next) {
+    next = c->next;
+    if (c->state == CONN_READ && now - c->since > READ_TIMEOUT) {
+      conn_close(loop, c);
+    }
+  }
+}
+
+/*
+ * One event loop serves many clients: non-blocking sockets, the frame ring
+ * eventfd and the listening socket are all multiplexed with epoll, so the
+ * cost of a viewer is its connection state and not a thread.
+ */
+static void *http_event_loop(void *arg)
+{
+  struct http_event_loop *loop = (struct http_event_loop *)arg;
+  struct frame_ring *ring = loop->srv->ring;
+  struct frame_ring *live = loop->srv->live;
+  struct epoll_event events[EVENT_MAX];
+  time_t now, last = time(NULL);
+  uint64_t v;
+  int i, n, busy, timeout;
+
+  while (!stop) {
+    timeout = http_event_pace(loop);
+    busy = ring_arm(ring, &loop->consumer);
+    busy |= http_event_live_arm(loop);
+    n = epoll_wait(loop->epfd, events, EVENT_MAX, busy ? 0 : timeout);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        http_event_accept(loop);
+      }
+      else if (events[i].data.ptr == loop) {
+        if (read(loop->consumer.efd, &v, sizeof(v)) < 0) {
+          perror("eventfd read");
+        }
+      }
+      else if (events[i].data.ptr == &loop->live) {
+        if (read(loop->live.efd, &v, sizeof(v)) < 0) {
+          perror("eventfd read");
+        }
+      }
+      else {
+        conn_event(loop, (struct http_conn *)events[i].data.ptr, events[i].events);
+      }
+    }
+
+    if (ring_head(ring) != loop->consumer.seq) {
+      http_event_dispatch(loop, ring, &loop->consumer);
+    }
+    if (live) {
+      http_event_live(loop);
+      if (ring_head(live) != loop->live.seq) {
+        http_event_dispatch(loop, live, &loop->live);
+      }
+    }
+
+    now = time(NULL);
+    if (now != last) {
+      http_event_timeout(loop, now);
+      last = now;
+    }
+  }
+
+  while (loop->conns) {
+    conn_close(loop, loop->conns);
+  }
+  ring_detach(ring, &loop->consumer);
+  if (live) {
+    ring_detach(live, &loop->live);
+  }
+  close(loop->epfd);
+  return NULL;
+}
+
+static int http_event_init(struct http_server *srv, struct http_event_loop *loop)
+{
+  struct epoll_event ev;
+
+  loop->srv = srv;
+  loop->conns = NULL;
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epfd < 0) {
+    perror("epoll_create1");
+    return -1;
+  }
+
+  if (ring_attach(srv->ring, &loop->consumer) < 0) {
+    close(loop->epfd);
+    return -1;
+  }
+
+  /* the listening socket is shared, only wake one loop per connection */
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, srv->sd, &ev) < 0) {
+    perror("epoll_ctl");
+    return -1;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = loop;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->consumer.efd, &ev) < 0) {
+    perror("epoll_ctl");
+    return -1;
+  }
+
+  if (srv->live) {
+    if (ring_attach(srv->live, &loop->live) < 0) {
+      return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->live;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->live.efd, &ev) < 0) {
+      perror("epoll_ctl");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int http_event_listener(struct http_server *srv)
+{
+  struct http_event_loop *loops;
+  int i;
+
+  if (fcntl(srv->sd, F_SETFL, fcntl(srv->sd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+    perror("fcntl(O_NONBLOCK) failed");
+    exit(1);
+  }
+
+  loops = calloc(srv->event_threads, sizeof(struct http_event_loop));
+  if (loops == NULL) {
+    fprintf(stderr, "could not allocate event loops\n");
+    return 1;
+  }
+
+  for (i = 0; i < srv->event_threads; i++) {
+    if (http_event_init(srv, &loops[i]) < 0) {
+      return 1;
+    }
+  }
+
+  /* the calling thread runs the first loop */
+  for (i = 1; i < srv->event_threads; i++) {
+    if (pthread_create(&loops[i].thread, NULL, http_event_loop, &loops[i]) != 0) {
+      perror("could not create event thread");
+      return 1;
+    }
+  }
+  http_event_loop(&loops[0]);
+
+  for (i = 1; i < srv->event_threads; i++) {
+    pthread_join(loops[i].thread, NULL);
+  }
+  free(loops);
+  return 0;
+}
 
 int http_listener(struct http_server *srv)
 {
@@ -431,6 +1609,10 @@ int http_listener(struct http_server *srv)
     exit(1);
   }
 
+  if (srv->event_threads > 0) {
+    return http_event_listener(srv);
+  }
+
   srv->client_thread = http_client_thread;
   while( 1 ) {
     /* alloc new client */
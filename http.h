@@ -11,16 +11,7 @@
 #ifndef _UVC_HTTPD_H
 #define _UVC_HTTPD_H
 
-struct buff {
-  int size;
-  unsigned char *buff;
-};
-
-struct thread_buff {
-  pthread_mutex_t lock;
-  pthread_cond_t  cond;
-  cqueue_t qbuff;
-};
+#include <stdint.h>
 
 /* client thread type */
 typedef void *(*client_thread_t)(void *);
@@ -30,13 +21,20 @@ struct http_server {
   int port;
   char *username;
   char *password;
-  struct thread_buff *ptbuff;
+  struct frame_ring *ring;
+  /* frames published before they are encoded, NULL if not available */
+  struct frame_ring *live;
   pthread_t client;
   client_thread_t client_thread;
-} server;
+  int event_threads;
+  /* pictures per second a stream gets at most, 0 for all of them */
+  double max_fps;
+};
+
+extern struct http_server server;
 
 typedef enum { AUTH_NONE, AUTH_PENDING, AUTH_CHECK } auth_state_t;
-typedef enum { UNKNOWN, INVALID, SNAPSHOT, STREAM } request_t;
+typedef enum { UNKNOWN, INVALID, SNAPSHOT, STREAM, METRICS, LATENCY } request_t;
 
 struct clientArgs {
   int socket;
@@ -44,8 +42,15 @@ struct clientArgs {
   struct http_server *server;
   auth_state_t auth_state;
   request_t request_type;
+  int fresh;
+  int live;
+  /* paced streams: ns between pictures and when the next one may be taken */
+  uint64_t period;
+  uint64_t due;
+  struct metrics_client *stats;
 };
 
 int http_listener(struct http_server *srv);
+void http_frame_part(struct frame *f);
 
 #endif
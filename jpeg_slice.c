@@ -0,0 +1,305 @@
+/*  slice parallel JPEG encoder
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <linux/videodev2.h>
+
+#include "v4l2uvc.h"
+#include "jpeg_utils.h"
+#include "jpeg_slice.h"
+
+/*
+ * The picture is cut in horizontal stripes of whole MCU rows, every stripe
+ * is compressed as a JPEG of its own with a restart marker after each MCU
+ * row. All stripes use the same tables, so the entropy coded data of the
+ * stripes can be put one after the other behind the headers of the first
+ * one, only the restart markers are renumbered and the height is fixed.
+ * The result is what a single encoder with restart_in_rows = 1 produces.
+ */
+
+struct slice_worker {
+  struct jpeg_slicer *slicer;
+  struct jpeg_encoder *encoder;
+  /* the stripe, only width, height and framebuffer are used */
+  struct vdIn vd;
+  unsigned char *buffer;
+  int capacity;
+  int size;
+  int first_row;
+  int index;
+  pthread_t thread;
+};
+
+struct jpeg_slicer {
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  unsigned int generation;
+  int pending;
+  int stop;
+  int format;
+  int quality;
+  int used;
+  int count;
+  struct slice_worker *workers;
+};
+
+static int slice_compress(struct slice_worker *w, int format, unsigned char *buffer, int size, int quality)
+{
+  switch (format) {
+  case V4L2_PIX_FMT_YUYV:
+    return compress_yuyv_to_jpeg(w->encoder, &w->vd, buffer, size, quality);
+  case V4L2_PIX_FMT_SRGGB8:
+    return compress_rggb_to_jpeg(w->encoder, &w->vd, buffer, size, quality);
+  case V4L2_PIX_FMT_RGB24:
+    return compress_rgb_to_jpeg(w->encoder, &w->vd, buffer, size, quality);
+  }
+  return 0;
+}
+
+static void *slice_thread(void *arg)
+{
+  struct slice_worker *w = (struct slice_worker *)arg;
+  struct jpeg_slicer *s = w->slicer;
+  unsigned int generation = 0;
+
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    while (s->generation == generation && !s->stop) {
+      pthread_cond_wait(&s->start, &s->lock);
+    }
+    if (s->stop) {
+      break;
+    }
+    generation = s->generation;
+    if (w->index >= s->used) {
+      continue;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    w->size = 0;
+    if (w->capacity > 0) {
+      w->size = slice_compress(w, s->format, w->buffer, w->capacity, s->quality);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (--s->pending == 0) {
+      pthread_cond_signal(&s->done);
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+/*
+ * Start a slicer with "threads" stripes, the caller encodes the first one
+ * itself so threads - 1 workers are started. Returns NULL on failure.
+ */
+struct jpeg_slicer *jpeg_slicer_new(int threads, int subsamp)
+{
+  struct jpeg_slicer *s;
+  struct slice_worker *w;
+  int i;
+
+  s = (struct jpeg_slicer *)calloc(1, sizeof(struct jpeg_slicer));
+  if (s == NULL) {
+    return NULL;
+  }
+  s->workers = (struct slice_worker *)calloc(threads, sizeof(struct slice_worker));
+  if (s->workers == NULL) {
+    free(s);
+    return NULL;
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->start, NULL);
+  pthread_cond_init(&s->done, NULL);
+
+  for (i = 0; i < threads; i++) {
+    w = &s->workers[i];
+    w->slicer = s;
+    w->index = i;
+    w->encoder = jpeg_encoder_new();
+    if (w->encoder == NULL) {
+      jpeg_slicer_free(s);
+      return NULL;
+    }
+    jpeg_encoder_subsampling(w->encoder, subsamp);
+    jpeg_encoder_restart(w->encoder, 1);
+
+    if (i > 0 && pthread_create(&w->thread, NULL, slice_thread, w) != 0) {
+      perror("pthread_create");
+      jpeg_encoder_free(w->encoder);
+      w->encoder = NULL;
+      jpeg_slicer_free(s);
+      return NULL;
+    }
+    s->count = i + 1;
+  }
+  return s;
+}
+
+void jpeg_slicer_free(struct jpeg_slicer *s)
+{
+  int i;
+
+  if (s == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&s->lock);
+  s->stop = 1;
+  pthread_cond_broadcast(&s->start);
+  pthread_mutex_unlock(&s->lock);
+
+  for (i = 0; i < s->count; i++) {
+    if (i > 0) {
+      pthread_join(s->workers[i].thread, NULL);
+    }
+    jpeg_encoder_free(s->workers[i].encoder);
+    free(s->workers[i].buffer);
+  }
+
+  pthread_cond_destroy(&s->done);
+  pthread_cond_destroy(&s->start);
+  pthread_mutex_destroy(&s->lock);
+  free(s->workers);
+  free(s);
+}
+
+/* offset of the entropy coded data, right after the SOS segment */
+static int slice_scan_start(unsigned char *jpeg, int len, int height)
+{
+  int p = 2, seglen;
+
+  while (p + 4 <= len && jpeg[p] == 0xff) {
+    seglen = (jpeg[p + 2] << 8) | jpeg[p + 3];
+    /* SOF0: length, precision, height, width */
+    if (jpeg[p + 1] == 0xc0 && height > 0 && p + 7 <= len) {
+      jpeg[p + 5] = height >> 8;
+      jpeg[p + 6] = height & 0xff;
+    }
+    if (jpeg[p + 1] == 0xda) {
+      return p + 2 + seglen;
+    }
+    p += 2 + seglen;
+  }
+  return -1;
+}
+
+/* copy entropy coded data, moving the restart markers on by "offset" */
+static int slice_copy(unsigned char *dst, const unsigned char *src, int len, int offset)
+{
+  const unsigned char *end = src + len, *p;
+  unsigned char *d = dst;
+
+  while (src < end) {
+    p = (const unsigned char *)memchr(src, 0xff, end - src);
+    if (p == NULL || p + 1 >= end) {
+      memcpy(d, src, end - src);
+      d += end - src;
+      break;
+    }
+    memcpy(d, src, p + 2 - src);
+    d += p + 2 - src;
+    if (p[1] >= 0xd0 && p[1] <= 0xd7) {
+      d[-1] = 0xd0 | ((p[1] - 0xd0 + offset) & 7);
+    }
+    src = p + 2;
+  }
+  return d - dst;
+}
+
+/*
+ * Compress the frame in vd in parallel stripes. The first stripe is written
+ * straight to buffer, the others are appended when all are done.
+ * Returns the JPEG size or 0 if it did not fit.
+ */
+int jpeg_slicer_compress(struct jpeg_slicer *s, struct vdIn *vd, unsigned char *buffer, int size, int quality)
+{
+  struct slice_worker *w;
+  int bpp, mcu, rows, per, line, len, start, i;
+
+  switch (vd->formatIn) {
+  case V4L2_PIX_FMT_YUYV:
+    bpp = 2;
+    break;
+  case V4L2_PIX_FMT_SRGGB8:
+    bpp = 1;
+    break;
+  case V4L2_PIX_FMT_RGB24:
+    bpp = 3;
+    break;
+  default:
+    return 0;
+  }
+
+  mcu = jpeg_encoder_mcu_lines(s->workers[0].encoder, vd->formatIn == V4L2_PIX_FMT_YUYV);
+  rows = (vd->height + mcu - 1) / mcu;
+  per = (rows + s->count - 1) / s->count;
+
+  for (i = 0; i * per < rows && i < s->count; i++) {
+    w = &s->workers[i];
+    line = i * per * mcu;
+    w->first_row = i * per;
+    w->vd.width = vd->width;
+    w->vd.height = (line + per * mcu < vd->height) ? per * mcu : vd->height - line;
+    w->vd.framebuffer = vd->framebuffer + line * vd->width * bpp;
+    w->vd.formatIn = vd->formatIn;
+
+    if (i > 0 && w->capacity < size) {
+      free(w->buffer);
+      w->buffer = (unsigned char *)malloc(size);
+      w->capacity = w->buffer ? size : 0;
+    }
+  }
+
+  pthread_mutex_lock(&s->lock);
+  s->format = vd->formatIn;
+  s->quality = quality;
+  s->used = i;
+  s->pending = i - 1;
+  s->generation++;
+  pthread_cond_broadcast(&s->start);
+  pthread_mutex_unlock(&s->lock);
+
+  len = slice_compress(&s->workers[0], vd->formatIn, buffer, size, quality);
+
+  pthread_mutex_lock(&s->lock);
+  while (s->pending > 0) {
+    pthread_cond_wait(&s->done, &s->lock);
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  /* fix the height in the headers of the first stripe and drop its EOI */
+  if (len < 4 || slice_scan_start(buffer, len, vd->height) < 0) {
+    return 0;
+  }
+  len -= 2;
+
+  for (i = 1; i < s->used; i++) {
+    w = &s->workers[i];
+    start = (w->size > 0) ? slice_scan_start(w->buffer, w->size, 0) : -1;
+    if (start < 0 || len + (w->size - start) + 2 > size) {
+      return 0;
+    }
+
+    /* restart marker after the last row of the previous stripe */
+    buffer[len++] = 0xff;
+    buffer[len++] = 0xd0 | ((w->first_row - 1) & 7);
+    len += slice_copy(buffer + len, w->buffer + start, w->size - start - 2, w->first_row);
+  }
+
+  buffer[len++] = 0xff;
+  buffer[len++] = 0xd9;
+  return len;
+}
@@ -0,0 +1,20 @@
+/*  slice parallel JPEG encoder
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#ifndef _JPEG_SLICE_H
+#define _JPEG_SLICE_H
+
+struct jpeg_slicer;
+
+struct jpeg_slicer *jpeg_slicer_new(int threads, int subsamp);
+void jpeg_slicer_free(struct jpeg_slicer *s);
+int jpeg_slicer_compress(struct jpeg_slicer *s, struct vdIn *vd, unsigned char *buffer, int size, int quality);
+
+#endif
@@ -28,25 +28,53 @@
 #include <stdlib.h>
 
 #include "v4l2uvc.h"
+#include "jpeg_utils.h"
+#include "pixconv.h"
 
-#define OUTPUT_BUF_SIZE  4096
+#define SPILL_BUF_SIZE  4096
+#define OUTPUT_CHUNK    8192  /* report compressed data in steps of this */
 
 typedef struct {
     struct jpeg_destination_mgr pub; /* public fields */
 
-    JOCTET * buffer;    /* start of buffer */
+    JOCTET * spill;     /* where the rest of a picture too big goes */
 
     unsigned char *outbuffer;
     int outbuffer_size;
-    unsigned char *outbuffer_cursor;
-    int *written;
+    int written;
+    int overflow;
+    int reported;
 
 } mjpg_destination_mgr;
 
 typedef mjpg_destination_mgr * mjpg_dest_ptr;
 
+/*
+ * Compressor state kept alive between frames, one per camera. libjpeg
+ * allows to compress several images with the same object, only the image
+ * parameters are set up again when the resolution or quality changes.
+ */
+struct jpeg_encoder {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *line_buffer;
+    /* Y, Cb and Cr planes of one iMCU row for raw data input */
+    unsigned char *raw_buffer;
+    JSAMPROW raw_rows[3][2 * DCTSIZE];
+    int width;
+    int height;
+    int quality;
+    int raw;
+    int subsamp;
+    int restart;
+    /* told about compressed data while the picture is being encoded */
+    struct jpeg_progress_mgr progress;
+    void (*output)(void *arg, int bytes);
+    void *output_arg;
+};
+
 /******************************************************************************
-Description.:
+Description.: libjpeg writes straight to the output buffer
 Input Value.:
 Return Value:
 ******************************************************************************/
@@ -54,17 +82,18 @@ METHODDEF(void) init_destination(j_compress_ptr cinfo)
 {
     mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
 
-    /* Allocate the output buffer --- it will be released when done with image */
-    dest->buffer = (JOCTET *)(*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_IMAGE, OUTPUT_BUF_SIZE * sizeof(JOCTET));
+    dest->written = 0;
+    dest->overflow = 0;
+    dest->reported = 0;
 
-    *(dest->written) = 0;
-
-    dest->pub.next_output_byte = dest->buffer;
-    dest->pub.free_in_buffer = OUTPUT_BUF_SIZE;
+    dest->pub.next_output_byte = dest->outbuffer;
+    dest->pub.free_in_buffer = dest->outbuffer_size;
 }
 
 /******************************************************************************
-Description.: called whenever local jpeg buffer fills up
+Description.: called when the output buffer is full, the picture does not fit.
+              The rest of it is thrown away and the frame reported as failed,
+              live clients that got the start of it are disconnected.
 Input Value.:
 Return Value:
 ******************************************************************************/
@@ -72,45 +101,67 @@ METHODDEF(boolean) empty_output_buffer(j_compress_ptr cinfo)
 {
     mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
 
-    memcpy(dest->outbuffer_cursor, dest->buffer, OUTPUT_BUF_SIZE);
-    dest->outbuffer_cursor += OUTPUT_BUF_SIZE;
-    *(dest->written) += OUTPUT_BUF_SIZE;
+    if(!dest->overflow)
+        fprintf(stderr, "JPEG larger than %d bytes, frame dropped\n", dest->outbuffer_size);
+    dest->overflow = 1;
 
-    dest->pub.next_output_byte = dest->buffer;
-    dest->pub.free_in_buffer = OUTPUT_BUF_SIZE;
+    dest->pub.next_output_byte = dest->spill;
+    dest->pub.free_in_buffer = SPILL_BUF_SIZE;
 
     return TRUE;
 }
 
 /******************************************************************************
 Description.: called by jpeg_finish_compress after all data has been written.
-              Usually needs to flush buffer.
 Input Value.:
 Return Value:
 ******************************************************************************/
 METHODDEF(void) term_destination(j_compress_ptr cinfo)
 {
     mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
-    size_t datacount = OUTPUT_BUF_SIZE - dest->pub.free_in_buffer;
 
-    /* Write any data remaining in the buffer */
-    memcpy(dest->outbuffer_cursor, dest->buffer, datacount);
-    dest->outbuffer_cursor += datacount;
-    *(dest->written) += datacount;
+    if(dest->overflow)
+        dest->written = 0;
+    else
+        dest->written = dest->outbuffer_size - dest->pub.free_in_buffer;
+}
+
+/******************************************************************************
+Description.: called by libjpeg before it takes the next lines, everything in
+              the buffer up to next_output_byte is final already
+Input Value.:
+Return Value:
+******************************************************************************/
+METHODDEF(void) progress_monitor(j_common_ptr cinfo)
+{
+    struct jpeg_encoder *enc = (struct jpeg_encoder *) cinfo;
+    mjpg_dest_ptr dest = (mjpg_dest_ptr) enc->cinfo.dest;
+    int bytes;
+
+    if(dest == NULL || dest->overflow)
+        return;
+
+    bytes = dest->outbuffer_size - dest->pub.free_in_buffer;
+    if(bytes - dest->reported >= OUTPUT_CHUNK) {
+        dest->reported = bytes;
+        enc->output(enc->output_arg, bytes);
+    }
 }
 
 /******************************************************************************
-Description.: Prepare for output to a stdio stream.
+Description.: Prepare for output to a memory buffer.
 Input Value.: buffer is the already allocated buffer memory that will hold
               the compressed picture. "size" is the size in bytes.
 Return Value: -
 ******************************************************************************/
-GLOBAL(void) dest_buffer(j_compress_ptr cinfo, unsigned char *buffer, int size, int *written)
+GLOBAL(void) dest_buffer(j_compress_ptr cinfo, unsigned char *buffer, int size)
 {
     mjpg_dest_ptr dest;
 
     if(cinfo->dest == NULL) {
         cinfo->dest = (struct jpeg_destination_mgr *)(*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_PERMANENT, sizeof(mjpg_destination_mgr));
+        dest = (mjpg_dest_ptr) cinfo->dest;
+        dest->spill = (JOCTET *)(*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_PERMANENT, SPILL_BUF_SIZE * sizeof(JOCTET));
     }
 
     dest = (mjpg_dest_ptr) cinfo->dest;
@@ -119,205 +170,296 @@ GLOBAL(void) dest_buffer(j_compress_ptr cinfo, unsigned char *buffer, int size,
     dest->pub.term_destination = term_destination;
     dest->outbuffer = buffer;
     dest->outbuffer_size = size;
-    dest->outbuffer_cursor = buffer;
-    dest->written = written;
 }
 
 /******************************************************************************
-Description.: yuv2jpeg function is based on compress_yuyv_to_jpeg written by
-              Gabriel A. Devenyi.
-              It uses the destination manager implemented above to compress
-              YUYV data to JPEG. Most other implementations use the
-              "jpeg_stdio_dest" from libjpeg, which can not store compressed
-              pictures to memory instead of a file.
-Input Value.: video structure from v4l2uvc.c/h, destination buffer and buffersize
-              the buffer must be large enough, no error/size checking is done!
-Return Value: the buffer will contain the compressed data
+Description.: allocate a compressor, it is set up on first use
+Input Value.: -
+Return Value: the encoder or NULL if out of memory
 ******************************************************************************/
-int compress_yuyv_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int quality)
+struct jpeg_encoder *jpeg_encoder_new(void)
 {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPROW row_pointer[1];
-    unsigned char *line_buffer, *yuyv;
-    int z;
-    static int written;
+    struct jpeg_encoder *enc;
 
-    line_buffer = calloc(vd->width * 3, 1);
-    yuyv = vd->framebuffer;
+    enc = (struct jpeg_encoder *)calloc(1, sizeof(struct jpeg_encoder));
+    if(enc == NULL)
+        return NULL;
 
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-    /* jpeg_stdio_dest (&cinfo, file); */
-    dest_buffer(&cinfo, buffer, size, &written);
+    enc->cinfo.err = jpeg_std_error(&enc->jerr);
+    jpeg_create_compress(&enc->cinfo);
+
+    pixconv_init();
+
+    return enc;
+}
 
-    cinfo.image_width = vd->width;
-    cinfo.image_height = vd->height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
+/******************************************************************************
+Description.: release the compressor and its scratch buffers
+Input Value.: encoder from jpeg_encoder_new(), may be NULL
+Return Value: -
+******************************************************************************/
+void jpeg_encoder_free(struct jpeg_encoder *enc)
+{
+    if(enc == NULL)
+        return;
 
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_destroy_compress(&enc->cinfo);
+    free(enc->line_buffer);
+    free(enc->raw_buffer);
+    free(enc);
+}
 
-    jpeg_start_compress(&cinfo, TRUE);
+/******************************************************************************
+Description.: select the chroma subsampling used for YUYV input
+Input Value.: encoder, JPEG_SUBSAMP_420 or JPEG_SUBSAMP_422
+Return Value: -
+******************************************************************************/
+void jpeg_encoder_subsampling(struct jpeg_encoder *enc, int subsamp)
+{
+    enc->subsamp = subsamp;
+    /* force a new setup */
+    enc->width = 0;
+}
 
-    z = 0;
-    while(cinfo.next_scanline < vd->height) {
-        int x;
-        unsigned char *ptr = line_buffer;
+/******************************************************************************
+Description.: emit a restart marker after every "rows" MCU rows, 0 disables
+              them. Slices encoded separately are joined at these markers.
+Input Value.: encoder, restart interval in MCU rows
+Return Value: -
+******************************************************************************/
+void jpeg_encoder_restart(struct jpeg_encoder *enc, int rows)
+{
+    enc->restart = rows;
+    /* force a new setup */
+    enc->width = 0;
+}
 
-        for(x = 0; x < vd->width; x++) {
-            int r, g, b;
-            int y, u, v;
+/******************************************************************************
+Description.: report the compressed data as it is produced: output(arg, bytes)
+              is called while a picture is encoded whenever some more bytes
+              at the start of the buffer are final. NULL turns it off.
+Input Value.: encoder, callback and its argument
+Return Value: -
+******************************************************************************/
+void jpeg_encoder_output(struct jpeg_encoder *enc, void (*output)(void *arg, int bytes), void *arg)
+{
+    enc->output = output;
+    enc->output_arg = arg;
+    enc->progress.progress_monitor = progress_monitor;
+    enc->cinfo.progress = output ? &enc->progress : NULL;
+}
 
-            if(!z)
-                y = yuyv[0] << 8;
-            else
-                y = yuyv[2] << 8;
-            u = yuyv[1] - 128;
-            v = yuyv[3] - 128;
+/******************************************************************************
+Description.: number of picture lines in one MCU row for the given input,
+              slices have to start at a multiple of it
+Input Value.: encoder, 1 for YUYV raw input
+Return Value: 8 or 16
+******************************************************************************/
+int jpeg_encoder_mcu_lines(struct jpeg_encoder *enc, int raw)
+{
+    /* RGB input gets the libjpeg default of 2x2 luma sampling */
+    return (raw && enc->subsamp == JPEG_SUBSAMP_422) ? DCTSIZE : 2 * DCTSIZE;
+}
 
-            r = (y + (359 * v)) >> 8;
-            g = (y - (88 * u) - (183 * v)) >> 8;
-            b = (y + (454 * u)) >> 8;
+/******************************************************************************
+Description.: allocate the planes of one iMCU row: a luma row is padded to
+              whole MCUs (16 pixels), the chroma rows are half as wide
+Input Value.: encoder, picture width, number of luma rows per iMCU row
+Return Value: 0 if ok, -1 if out of memory
+******************************************************************************/
+static int jpeg_encoder_raw_buffer(struct jpeg_encoder *enc, int width, int rows)
+{
+    unsigned char *raw_buffer, *ptr;
+    int ywidth = (width + 2 * DCTSIZE - 1) & ~(2 * DCTSIZE - 1);
+    int i;
+
+    raw_buffer = (unsigned char *)realloc(enc->raw_buffer, ywidth * rows * 2);
+    if(raw_buffer == NULL)
+        return -1;
+    enc->raw_buffer = raw_buffer;
+
+    ptr = raw_buffer;
+    for(i = 0; i < rows; i++, ptr += ywidth)
+        enc->raw_rows[0][i] = ptr;
+    for(i = 0; i < DCTSIZE; i++, ptr += ywidth / 2)
+        enc->raw_rows[1][i] = ptr;
+    for(i = 0; i < DCTSIZE; i++, ptr += ywidth / 2)
+        enc->raw_rows[2][i] = ptr;
+
+    return 0;
+}
 
-            *(ptr++) = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-            *(ptr++) = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-            *(ptr++) = (b > 255) ? 255 : ((b < 0) ? 0 : b);
+/******************************************************************************
+Description.: set the image parameters and quantization tables, only when the
+              picture size, quality or input type differs from the previous
+              frame
+Input Value.: encoder, picture size, quality and raw = 1 for YCbCr planes
+Return Value: 0 if ok, -1 if out of memory
+******************************************************************************/
+static int jpeg_encoder_setup(struct jpeg_encoder *enc, int width, int height, int quality, int raw)
+{
+    struct jpeg_compress_struct *cinfo = &enc->cinfo;
+    unsigned char *line_buffer;
+    int vsamp = (enc->subsamp == JPEG_SUBSAMP_422) ? 1 : 2;
 
-            if(z++) {
-                z = 0;
-                yuyv += 4;
-            }
-        }
+    if(enc->width == width && enc->height == height && enc->quality == quality && enc->raw == raw)
+        return 0;
 
-        row_pointer[0] = line_buffer;
-        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    if(raw) {
+        if(jpeg_encoder_raw_buffer(enc, width, vsamp * DCTSIZE) < 0)
+            return -1;
+    }
+    else {
+        line_buffer = (unsigned char *)realloc(enc->line_buffer, width * 3);
+        if(line_buffer == NULL)
+            return -1;
+        enc->line_buffer = line_buffer;
     }
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = raw ? JCS_YCbCr : JCS_RGB;
+
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, quality, TRUE);
+    cinfo->restart_in_rows = enc->restart;
+
+    if(raw) {
+        cinfo->raw_data_in = TRUE;
+        cinfo->comp_info[0].h_samp_factor = 2;
+        cinfo->comp_info[0].v_samp_factor = vsamp;
+        cinfo->comp_info[1].h_samp_factor = 1;
+        cinfo->comp_info[1].v_samp_factor = 1;
+        cinfo->comp_info[2].h_samp_factor = 1;
+        cinfo->comp_info[2].v_samp_factor = 1;
+    }
 
-    free(line_buffer);
+    enc->width = width;
+    enc->height = height;
+    enc->quality = quality;
+    enc->raw = raw;
 
-    return (written);
+    return 0;
 }
-int compress_rggb_to_jpeg(struct vdIn *vd, unsigned char* buffer, int size, int quality)
-{
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPROW row_pointer[1];
-    unsigned char *line_buffer, *rgb;
-    int z;
-    static int written;
-
-    line_buffer = calloc(vd->width * 3, 1);
-    rgb = vd->framebuffer;
 
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-    /* jpeg_stdio_dest (&cinfo, file); */
-    dest_buffer(&cinfo, buffer, size, &written);
+static int jpeg_encoder_written(struct jpeg_encoder *enc)
+{
+    return ((mjpg_dest_ptr) enc->cinfo.dest)->written;
+}
 
-    cinfo.image_width = vd->width;
-    cinfo.image_height = vd->height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
+/******************************************************************************
+Description.: yuv2jpeg function is based on compress_yuyv_to_jpeg written by
+              Gabriel A. Devenyi.
+              YUYV already is YCbCr 4:2:2, so it is split into Y, Cb and Cr
+              planes and handed to libjpeg as raw data, without converting it
+              to RGB and back. Chroma is used as is for 4:2:2 or averaged
+              over two lines for 4:2:0.
+Input Value.: encoder, video structure from v4l2uvc.c/h, destination buffer
+              and buffersize
+Return Value: size of the compressed data in the buffer, 0 if it did not fit
+******************************************************************************/
+int compress_yuyv_to_jpeg(struct jpeg_encoder *enc, struct vdIn *vd, unsigned char *buffer, int size, int quality)
+{
+    struct jpeg_compress_struct *cinfo = &enc->cinfo;
+    JSAMPARRAY planes[3];
+    int ywidth, cwidth, rows, line, r, x;
+    int half = vd->width / 2;
 
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
+    if(jpeg_encoder_setup(enc, vd->width, vd->height, quality, 1) < 0)
+        return 0;
 
-    jpeg_start_compress(&cinfo, TRUE);
+    rows = cinfo->comp_info[0].v_samp_factor * DCTSIZE;
+    ywidth = (vd->width + 2 * DCTSIZE - 1) & ~(2 * DCTSIZE - 1);
+    cwidth = ywidth / 2;
+    planes[0] = enc->raw_rows[0];
+    planes[1] = enc->raw_rows[1];
+    planes[2] = enc->raw_rows[2];
 
-    z = 0;
-    while(cinfo.next_scanline < vd->height) {
-        int x;
-        unsigned char *ptr = line_buffer;
+    /* jpeg_stdio_dest (&cinfo, file); */
+    dest_buffer(cinfo, buffer, size);
 
-        for(x = 0; x < vd->width; x++) {
-            int r, g, b;
-            
-            r = rgb[0];
-            g = (rgb[1] + rgb[2]) / 2;
-            b = rgb[3];
+    jpeg_start_compress(cinfo, TRUE);
 
-            *(ptr++) = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-            *(ptr++) = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-            *(ptr++) = (b > 255) ? 255 : ((b < 0) ? 0 : b);
+    for(line = 0; line < vd->height; line += rows) {
+        for(r = 0; r < rows; r++) {
+            /* the last iMCU row is padded by repeating the last line */
+            int l = (line + r < vd->height) ? line + r : vd->height - 1;
+            unsigned char *yuyv = vd->framebuffer + l * vd->width * 2;
+            unsigned char *py = planes[0][r];
+            unsigned char *pu = planes[1][r * DCTSIZE / rows];
+            unsigned char *pv = planes[2][r * DCTSIZE / rows];
 
-             if(z++ == 3) {
-                z = 0;
-                rgb += 4;
+            if(rows == DCTSIZE || !(r & 1))
+                pixconv.yuyv_split(yuyv, py, pu, pv, vd->width);
+            else
+                pixconv.yuyv_split_avg(yuyv, py, pu, pv, vd->width);
+
+            /* pad to whole MCUs by repeating the last column */
+            for(x = vd->width; x < ywidth; x++)
+                py[x] = py[vd->width - 1];
+            for(x = half; x < cwidth; x++) {
+                pu[x] = pu[half - 1];
+                pv[x] = pv[half - 1];
             }
-            
         }
 
-        row_pointer[0] = line_buffer;
-        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+        jpeg_write_raw_data(cinfo, planes, rows);
     }
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
-
-    free(line_buffer);
+    jpeg_finish_compress(cinfo);
 
-    return (written);
+    return jpeg_encoder_written(enc);
 }
-
-int compress_rgb_to_jpeg(struct vdIn *src, unsigned char* buffer, int size, int quality)
+int compress_rggb_to_jpeg(struct jpeg_encoder *enc, struct vdIn *vd, unsigned char* buffer, int size, int quality)
 {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    struct jpeg_compress_struct *cinfo = &enc->cinfo;
     JSAMPROW row_pointer[1];
-    
-    unsigned char *line_buffer, *rgb;
-    static int written;
+    unsigned char *rggb;
+
+    if(jpeg_encoder_setup(enc, vd->width, vd->height, quality, 0) < 0)
+        return 0;
 
-    line_buffer = (unsigned char*)calloc (src->width * 3, 1);
-    rgb = src->framebuffer;
+    rggb = vd->framebuffer;
+    row_pointer[0] = enc->line_buffer;
 
-    cinfo.err = jpeg_std_error (&jerr);
-    jpeg_create_compress (&cinfo);
     /* jpeg_stdio_dest (&cinfo, file); */
-    dest_buffer(&cinfo, buffer, size, &written);
+    dest_buffer(cinfo, buffer, size);
 
-    cinfo.image_width = src->width;
-    cinfo.image_height = src->height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
+    jpeg_start_compress(cinfo, TRUE);
 
-    jpeg_set_defaults (&cinfo);
-    jpeg_set_quality (&cinfo, quality, TRUE);
+    while(cinfo->next_scanline < vd->height) {
+        pixconv.rggb_to_rgb(rggb, enc->line_buffer, vd->width);
+        rggb += vd->width;
 
-    jpeg_start_compress (&cinfo, TRUE);
+        jpeg_write_scanlines(cinfo, row_pointer, 1);
+    }
 
-    while (cinfo.next_scanline < src->height) {
-        int x;
-        unsigned char *ptr = line_buffer;
+    jpeg_finish_compress(cinfo);
 
-        for (x = 0; x < src->width; x++) {
-            int r, g, b;
+    return jpeg_encoder_written(enc);
+}
 
-            r = rgb[0];
-            g = rgb[1];
-            b = rgb[2];
+int compress_rgb_to_jpeg(struct jpeg_encoder *enc, struct vdIn *src, unsigned char* buffer, int size, int quality)
+{
+    struct jpeg_compress_struct *cinfo = &enc->cinfo;
+    JSAMPROW row_pointer[1];
 
-            *(ptr++) = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-            *(ptr++) = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-            *(ptr++) = (b > 255) ? 255 : ((b < 0) ? 0 : b);
+    if (jpeg_encoder_setup(enc, src->width, src->height, quality, 0) < 0)
+        return 0;
 
-            rgb += 3;
-        }
+    /* jpeg_stdio_dest (&cinfo, file); */
+    dest_buffer(cinfo, buffer, size);
 
-        row_pointer[0] = line_buffer;
-        jpeg_write_scanlines (&cinfo, row_pointer, 1);
-    }
+    jpeg_start_compress (cinfo, TRUE);
 
-    jpeg_finish_compress (&cinfo);
-    jpeg_destroy_compress (&cinfo);
+    /* RGB24 is what libjpeg wants already, hand it the lines of the frame */
+    while (cinfo->next_scanline < src->height) {
+        row_pointer[0] = src->framebuffer + cinfo->next_scanline * src->width * 3;
+        jpeg_write_scanlines (cinfo, row_pointer, 1);
+    }
 
-    free (line_buffer);
+    jpeg_finish_compress (cinfo);
 
-    return (written);
+    return jpeg_encoder_written(enc);
 }
-
@@ -1,9 +1,22 @@
 #ifndef _JPEG_UTILS_H
 #define _JPEG_UTILS_H
 
-int compress_yuyv_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int quality);
-int compress_rggb_to_jpeg(struct vdIn *src, unsigned char* buffer, int size, int quality);
-int compress_rgb_to_jpeg(struct vdIn *src, unsigned char* buffer, int size, int quality);
+/* chroma subsampling of YUYV input */
+#define JPEG_SUBSAMP_420  0
+#define JPEG_SUBSAMP_422  1
+
+struct jpeg_encoder;
+
+struct jpeg_encoder *jpeg_encoder_new(void);
+void jpeg_encoder_free(struct jpeg_encoder *enc);
+void jpeg_encoder_subsampling(struct jpeg_encoder *enc, int subsamp);
+void jpeg_encoder_restart(struct jpeg_encoder *enc, int rows);
+int jpeg_encoder_mcu_lines(struct jpeg_encoder *enc, int raw);
+void jpeg_encoder_output(struct jpeg_encoder *enc, void (*output)(void *arg, int bytes), void *arg);
+
+int compress_yuyv_to_jpeg(struct jpeg_encoder *enc, struct vdIn *vd, unsigned char *buffer, int size, int quality);
+int compress_rggb_to_jpeg(struct jpeg_encoder *enc, struct vdIn *src, unsigned char* buffer, int size, int quality);
+int compress_rgb_to_jpeg(struct jpeg_encoder *enc, struct vdIn *src, unsigned char* buffer, int size, int quality);
 
 #endif
 
@@ -0,0 +1,465 @@
+/*  pipeline counters, exported on /metrics
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "v4l2uvc.h"
+#include "spsc.h"
+#include "ring.h"
+#include "recq.h"
+#include "metrics.h"
+
+/* room for the counters and three lines per client */
+#define METRICS_MAX  (4096 + METRICS_CLIENTS * 512)
+
+struct metrics metrics;
+
+/* upper bounds of the encode time buckets in microseconds, the last one is +Inf */
+static const unsigned long encode_bounds[METRICS_BUCKETS] = {
+  1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000
+};
+
+/* output of metrics_frame() */
+struct metrics_buf {
+  char *data;
+  int len;
+  int size;
+};
+
+/* called by the capture thread for every picture the source delivered */
+void metrics_captured(void)
+{
+  struct timespec now;
+
+  __atomic_add_fetch(&metrics.captured, 1, __ATOMIC_RELAXED);
+
+  /* pictures of the last full second */
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  if (now.tv_sec != metrics.fps_sec) {
+    __atomic_store_n(&metrics.fps, (now.tv_sec == metrics.fps_sec + 1) ? metrics.fps_count : 0,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&metrics.fps_sec, now.tv_sec, __ATOMIC_RELAXED);
+    metrics.fps_count = 0;
+  }
+  metrics.fps_count++;
+}
+
+/* called by the encoder thread once a picture is done */
+void metrics_encoded(const struct frame_times *t, int ok)
+{
+  unsigned long usec = (t->encode_end - t->encode_start) / 1000;
+  int i;
+
+  for (i = 0; i < METRICS_BUCKETS && usec > encode_bounds[i]; i++);
+  __atomic_add_fetch(&metrics.encode_hist[i], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&metrics.encode_usec, usec, __ATOMIC_RELAXED);
+  __atomic_add_fetch(ok ? &metrics.encoded : &metrics.encode_errors, 1, __ATOMIC_RELAXED);
+
+  metrics_latency(LATENCY_QUEUE, t->dequeue, t->encode_start);
+  metrics_latency(LATENCY_ENCODE, t->encode_start, t->encode_end);
+}
+
+static int latency_bucket(unsigned long usec)
+{
+  int e, idx;
+
+  if (usec < LATENCY_SUB) {
+    return usec;
+  }
+  e = 63 - __builtin_clzl(usec);
+  idx = (e - LATENCY_SUB_BITS + 1) * LATENCY_SUB + ((usec >> (e - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+  return (idx < LATENCY_BUCKETS) ? idx : LATENCY_BUCKETS - 1;
+}
+
+/* largest value that falls into bucket idx */
+static unsigned long latency_bound(int idx)
+{
+  int e;
+
+  if (idx < LATENCY_SUB) {
+    return idx;
+  }
+  e = idx / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+  return ((unsigned long)(LATENCY_SUB + idx % LATENCY_SUB + 1) << (e - LATENCY_SUB_BITS)) - 1;
+}
+
+/* add the time from "from" to "to" (frame_clock() ns) to a stage, 0 means unknown */
+void metrics_latency(enum latency_stage stage, uint64_t from, uint64_t to)
+{
+  struct latency_hist *h = &metrics.latency[stage];
+  unsigned long usec, max;
+
+  if (from == 0 || to < from) {
+    return;
+  }
+  usec = (to - from) / 1000;
+
+  __atomic_add_fetch(&h->buckets[latency_bucket(usec)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->sum, usec, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+  max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  while (usec > max &&
+         !__atomic_compare_exchange_n(&h->max, &max, usec, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* a streaming client got all of f */
+void metrics_frame_sent(const struct frame *f)
+{
+  uint64_t now = frame_clock();
+
+  metrics_latency(LATENCY_SEND, f->times.publish, now);
+  metrics_latency(LATENCY_TOTAL, f->times.driver ? f->times.driver : f->times.dequeue, now);
+}
+
+/*
+ * Take a free client slot, a client that finds none is counted in the
+ * shared "others" slot. Never returns NULL.
+ */
+struct metrics_client *metrics_client_open(struct sockaddr_in *addr)
+{
+  struct metrics_client *mc;
+  int i, state;
+
+  __atomic_add_fetch(&metrics.clients, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&metrics.connections, 1, __ATOMIC_RELAXED);
+
+  for (i = 0; i < METRICS_CLIENTS; i++) {
+    mc = &metrics.slots[i];
+    state = 0;
+    if (__atomic_load_n(&mc->state, __ATOMIC_RELAXED) == 0 &&
+        __atomic_compare_exchange_n(&mc->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      __atomic_add_fetch(&mc->gen, 1, __ATOMIC_RELAXED);
+      mc->addr = *addr;
+      mc->bytes0 = mc->bytes;
+      mc->frames0 = mc->frames;
+      mc->skipped0 = mc->skipped;
+      __atomic_store_n(&mc->state, 2, __ATOMIC_RELEASE);
+      return mc;
+    }
+  }
+  return &metrics.others;
+}
+
+void metrics_client_close(struct metrics_client *mc)
+{
+  if (mc == NULL) {
+    return;
+  }
+  __atomic_sub_fetch(&metrics.clients, 1, __ATOMIC_RELAXED);
+  if (mc != &metrics.others) {
+    __atomic_store_n(&mc->state, 0, __ATOMIC_RELEASE);
+  }
+}
+
+void metrics_sent(struct metrics_client *mc, int bytes, int frames)
+{
+  __atomic_add_fetch(&mc->bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&mc->frames, frames, __ATOMIC_RELAXED);
+}
+
+/* frames a streaming client did not get because it was too slow for them */
+void metrics_skipped(struct metrics_client *mc, unsigned int frames)
+{
+  __atomic_add_fetch(&mc->skipped, frames, __ATOMIC_RELAXED);
+}
+
+static void metrics_printf(struct metrics_buf *mb, const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  if (mb->len >= mb->size) {
+    return;
+  }
+  va_start(ap, fmt);
+  n = vsnprintf(mb->data + mb->len, mb->size - mb->len, fmt, ap);
+  va_end(ap);
+  mb->len = (n < 0 || mb->len + n > mb->size) ? mb->size : mb->len + n;
+}
+
+static void metrics_value(struct metrics_buf *mb, const char *name, const char *type,
+                          const char *help, unsigned long value)
+{
+  metrics_printf(mb, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type, name, value);
+}
+
+static void metrics_head(struct metrics_buf *mb, const char *name, const char *type,
+                         const char *help)
+{
+  metrics_printf(mb, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* a consistent copy of a slot in use, 0 if it is not in use */
+static int metrics_client_copy(struct metrics_client *mc, struct metrics_client *copy)
+{
+  unsigned int gen = __atomic_load_n(&mc->gen, __ATOMIC_ACQUIRE);
+
+  if (__atomic_load_n(&mc->state, __ATOMIC_ACQUIRE) != 2) {
+    return 0;
+  }
+  copy->addr = mc->addr;
+  copy->bytes = __atomic_load_n(&mc->bytes, __ATOMIC_RELAXED) - mc->bytes0;
+  copy->frames = __atomic_load_n(&mc->frames, __ATOMIC_RELAXED) - mc->frames0;
+  copy->skipped = __atomic_load_n(&mc->skipped, __ATOMIC_RELAXED) - mc->skipped0;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  return __atomic_load_n(&mc->state, __ATOMIC_RELAXED) == 2 &&
+         __atomic_load_n(&mc->gen, __ATOMIC_RELAXED) == gen;
+}
+
+static void metrics_clients(struct metrics_buf *mb)
+{
+  struct metrics_client copies[METRICS_CLIENTS], *mc;
+  unsigned long bytes, frames, skipped;
+  char addr[INET_ADDRSTRLEN];
+  int used[METRICS_CLIENTS];
+  int i;
+
+  bytes = __atomic_load_n(&metrics.others.bytes, __ATOMIC_RELAXED);
+  frames = __atomic_load_n(&metrics.others.frames, __ATOMIC_RELAXED);
+  skipped = __atomic_load_n(&metrics.others.skipped, __ATOMIC_RELAXED);
+  for (i = 0; i < METRICS_CLIENTS; i++) {
+    mc = &metrics.slots[i];
+    bytes += __atomic_load_n(&mc->bytes, __ATOMIC_RELAXED);
+    frames += __atomic_load_n(&mc->frames, __ATOMIC_RELAXED);
+    skipped += __atomic_load_n(&mc->skipped, __ATOMIC_RELAXED);
+    used[i] = metrics_client_copy(mc, &copies[i]);
+  }
+
+  metrics_value(mb, "uvc_clients", "gauge", "Connected clients.",
+                __atomic_load_n(&metrics.clients, __ATOMIC_RELAXED));
+  metrics_value(mb, "uvc_connections_total", "counter", "Accepted connections.",
+                __atomic_load_n(&metrics.connections, __ATOMIC_RELAXED));
+  metrics_value(mb, "uvc_sent_bytes_total", "counter", "Bytes sent to all clients.", bytes);
+  metrics_value(mb, "uvc_sent_frames_total", "counter", "Pictures sent to all clients.", frames);
+  metrics_value(mb, "uvc_skipped_frames_total", "counter",
+                "Pictures streaming clients did not get, too slow or paced with ?fps.", skipped);
+
+  metrics_head(mb, "uvc_client_sent_bytes_total", "counter", "Bytes sent to a client.");
+  for (i = 0; i < METRICS_CLIENTS; i++) {
+    if (used[i]) {
+      inet_ntop(AF_INET, &copies[i].addr.sin_addr, addr, sizeof(addr));
+      metrics_printf(mb, "uvc_client_sent_bytes_total{client=\"%s:%d\"} %lu\n",
+                     addr, ntohs(copies[i].addr.sin_port), copies[i].bytes);
+    }
+  }
+  metrics_head(mb, "uvc_client_sent_frames_total", "counter", "Pictures sent to a client.");
+  for (i = 0; i < METRICS_CLIENTS; i++) {
+    if (used[i]) {
+      inet_ntop(AF_INET, &copies[i].addr.sin_addr, addr, sizeof(addr));
+      metrics_printf(mb, "uvc_client_sent_frames_total{client=\"%s:%d\"} %lu\n",
+                     addr, ntohs(copies[i].addr.sin_port), copies[i].frames);
+    }
+  }
+  metrics_head(mb, "uvc_client_skipped_frames_total", "counter", "Pictures a client missed.");
+  for (i = 0; i < METRICS_CLIENTS; i++) {
+    if (used[i]) {
+      inet_ntop(AF_INET, &copies[i].addr.sin_addr, addr, sizeof(addr));
+      metrics_printf(mb, "uvc_client_skipped_frames_total{client=\"%s:%d\"} %lu\n",
+                     addr, ntohs(copies[i].addr.sin_port), copies[i].skipped);
+    }
+  }
+}
+
+static void metrics_encoder(struct metrics_buf *mb)
+{
+  unsigned long count = 0;
+  int i;
+
+  metrics_value(mb, "uvc_encode_frames_total", "counter", "Pictures encoded.",
+                __atomic_load_n(&metrics.encoded, __ATOMIC_RELAXED));
+  metrics_value(mb, "uvc_encode_errors_total", "counter", "Pictures the encoder failed on.",
+                __atomic_load_n(&metrics.encode_errors, __ATOMIC_RELAXED));
+
+  metrics_head(mb, "uvc_encode_seconds", "histogram", "Time to encode a picture.");
+  for (i = 0; i <= METRICS_BUCKETS; i++) {
+    count += __atomic_load_n(&metrics.encode_hist[i], __ATOMIC_RELAXED);
+    if (i < METRICS_BUCKETS) {
+      metrics_printf(mb, "uvc_encode_seconds_bucket{le=\"%g\"} %lu\n",
+                     encode_bounds[i] / 1e6, count);
+    } else {
+      metrics_printf(mb, "uvc_encode_seconds_bucket{le=\"+Inf\"} %lu\n", count);
+    }
+  }
+  metrics_printf(mb, "uvc_encode_seconds_sum %.6f\nuvc_encode_seconds_count %lu\n",
+                 __atomic_load_n(&metrics.encode_usec, __ATOMIC_RELAXED) / 1e6, count);
+
+  if (metrics.queue) {
+    metrics_value(mb, "uvc_encode_queued_total", "counter", "Raw pictures queued for the encoder.",
+                  __atomic_load_n(&metrics.queue->pushed, __ATOMIC_RELAXED));
+    metrics_value(mb, "uvc_encode_dropped_total", "counter",
+                  "Raw pictures dropped because the encoder was behind.",
+                  __atomic_load_n(&metrics.queue->dropped, __ATOMIC_RELAXED));
+    metrics_value(mb, "uvc_encode_queue_depth", "gauge", "Raw pictures waiting for the encoder.",
+                  spsc_depth(metrics.queue));
+  }
+}
+
+static void metrics_release(struct frame *f)
+{
+  free(f);
+}
+
+/* a text report, sent like a picture and freed with the last reference */
+static struct frame *metrics_report(int size)
+{
+  struct frame *f;
+
+  f = calloc(1, sizeof(struct frame) + size);
+  if (f == NULL) {
+    return NULL;
+  }
+  f->buff = (unsigned char *)(f + 1);
+  f->capacity = size;
+  f->refcount = 1;
+  f->release = metrics_release;
+  gettimeofday(&f->timestamp, NULL);
+  return f;
+}
+
+/* all counters in the Prometheus text format */
+struct frame *metrics_frame(void)
+{
+  struct metrics_buf mb;
+  struct frame *f;
+  struct timespec now;
+  time_t sec;
+
+  f = metrics_report(METRICS_MAX);
+  if (f == NULL) {
+    return NULL;
+  }
+
+  mb.data = (char *)f->buff;
+  mb.len = 0;
+  mb.size = METRICS_MAX;
+
+  /* a rate is only current while pictures come in */
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  sec = __atomic_load_n(&metrics.fps_sec, __ATOMIC_RELAXED);
+
+  metrics_value(&mb, "uvc_capture_frames_total", "counter", "Pictures delivered by the source.",
+                __atomic_load_n(&metrics.captured, __ATOMIC_RELAXED));
+  metrics_value(&mb, "uvc_capture_fps", "gauge", "Pictures captured in the last full second.",
+                (now.tv_sec - sec <= 1) ? __atomic_load_n(&metrics.fps, __ATOMIC_RELAXED) : 0);
+  if (metrics.vd) {
+    metrics_value(&mb, "uvc_capture_dqbuf_errors_total", "counter", "Failed VIDIOC_DQBUF calls.",
+                  __atomic_load_n(&metrics.vd->dqbuf_errors, __ATOMIC_RELAXED));
+    metrics_value(&mb, "uvc_capture_empty_buffers_total", "counter",
+                  "Buffers ignored because the driver returned no picture.",
+                  __atomic_load_n(&metrics.vd->empty_buffers, __ATOMIC_RELAXED));
+  }
+
+  metrics_encoder(&mb);
+
+  if (metrics.ring) {
+    metrics_head(&mb, "uvc_viewers", "gauge", "Clients waiting for or getting pictures.");
+    metrics_printf(&mb, "uvc_viewers{stream=\"jpeg\"} %d\n", ring_viewers(metrics.ring));
+    if (metrics.live) {
+      metrics_printf(&mb, "uvc_viewers{stream=\"live\"} %d\n", ring_viewers(metrics.live));
+    }
+  }
+  metrics_clients(&mb);
+
+  if (metrics.recq) {
+    metrics_value(&mb, "uvc_record_frames_total", "counter", "Pictures written to the recording.",
+                  __atomic_load_n(&metrics.recq->written, __ATOMIC_RELAXED));
+    metrics_value(&mb, "uvc_record_dropped_total", "counter",
+                  "Pictures not recorded because the recorder queue was full.",
+                  __atomic_load_n(&metrics.recq->dropped, __ATOMIC_RELAXED));
+    metrics_value(&mb, "uvc_record_skipped_total", "counter",
+                  "Pictures not recorded because they were dropped before they were published.",
+                  __atomic_load_n(&metrics.recq->skipped, __ATOMIC_RELAXED));
+    metrics_value(&mb, "uvc_record_queue_bytes", "gauge", "Memory used by pictures waiting to be recorded.",
+                  recq_used(metrics.recq));
+    metrics_value(&mb, "uvc_record_queue_budget_bytes", "gauge", "Memory for pictures waiting to be recorded.",
+                  metrics.recq->size);
+  }
+
+  f->size = mb.len;
+  return f;
+}
+
+static const char *latency_names[LATENCY_STAGES] = {
+  "capture", "queue", "encode", "publish", "send", "total"
+};
+
+/* upper bound of the bucket that holds quantile q of h */
+static unsigned long latency_quantile(const unsigned long *buckets, unsigned long count,
+                                      unsigned long max, double q)
+{
+  unsigned long rank = (unsigned long)(q * count + 0.999999), n = 0;
+  int i;
+
+  for (i = 0; i < LATENCY_BUCKETS; i++) {
+    n += buckets[i];
+    if (n >= rank) {
+      break;
+    }
+  }
+  return (latency_bound(i) < max) ? latency_bound(i) : max;
+}
+
+/*
+ * Print one line per stage with count, mean, percentiles and maximum in
+ * microseconds. Also used from the SIGUSR1 handler, so no allocations.
+ */
+int metrics_latency_print(char *buf, int size)
+{
+  struct metrics_buf mb;
+  unsigned long buckets[LATENCY_BUCKETS];
+  unsigned long count, sum, max;
+  int s, i;
+
+  mb.data = buf;
+  mb.len = 0;
+  mb.size = size;
+
+  metrics_printf(&mb, "%-8s %10s %8s %8s %8s %8s %8s %8s  (usec)\n",
+                 "stage", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+  for (s = 0; s < LATENCY_STAGES; s++) {
+    count = 0;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+      buckets[i] = __atomic_load_n(&metrics.latency[s].buckets[i], __ATOMIC_RELAXED);
+      count += buckets[i];
+    }
+    sum = __atomic_load_n(&metrics.latency[s].sum, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&metrics.latency[s].max, __ATOMIC_RELAXED);
+    if (count == 0) {
+      metrics_printf(&mb, "%-8s %10d %8s %8s %8s %8s %8s %8s\n", latency_names[s], 0,
+                     "-", "-", "-", "-", "-", "-");
+      continue;
+    }
+    metrics_printf(&mb, "%-8s %10lu %8lu %8lu %8lu %8lu %8lu %8lu\n", latency_names[s], count,
+                   sum / count,
+                   latency_quantile(buckets, count, max, 0.5),
+                   latency_quantile(buckets, count, max, 0.9),
+                   latency_quantile(buckets, count, max, 0.99),
+                   latency_quantile(buckets, count, max, 0.999), max);
+  }
+  return mb.len;
+}
+
+struct frame *metrics_latency_frame(void)
+{
+  struct frame *f;
+
+  f = metrics_report(LATENCY_REPORT);
+  if (f == NULL) {
+    return NULL;
+  }
+  f->size = metrics_latency_print((char *)f->buff, f->capacity);
+  return f;
+}
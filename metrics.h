@@ -0,0 +1,124 @@
+/*  pipeline counters, exported on /metrics
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <time.h>
+#include <netinet/in.h>
+
+#include "frame.h"
+
+#ifndef CACHELINE
+#define CACHELINE   64
+#endif
+
+/* clients with counters of their own, more are only counted in the totals */
+#define METRICS_CLIENTS  32
+/* encode time histogram buckets, see metrics.c */
+#define METRICS_BUCKETS  10
+
+/* latency histograms: 8 linear steps per power of two microseconds */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB      (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS  (30 * LATENCY_SUB)
+/* room for the latency report */
+#define LATENCY_REPORT   1024
+
+struct vdIn;
+struct spsc_queue;
+struct frame_ring;
+struct rec_queue;
+
+/* pipeline stages with a latency histogram, all times come from struct frame_times */
+enum latency_stage {
+  LATENCY_CAPTURE,   /* driver capture time to dequeue */
+  LATENCY_QUEUE,     /* dequeue to encode start */
+  LATENCY_ENCODE,    /* encode start to end */
+  LATENCY_PUBLISH,   /* dequeue or encode end to publish */
+  LATENCY_SEND,      /* publish to the last byte written to a streaming client */
+  LATENCY_TOTAL,     /* capture (dequeue if unknown) to the last byte written */
+  LATENCY_STAGES
+};
+
+/*
+ * Log-linear histogram of microseconds, every bucket is within 1/8 of its
+ * value. Writers only do relaxed atomic adds.
+ */
+struct latency_hist {
+  unsigned long count;
+  unsigned long sum;
+  unsigned long max;
+  unsigned long buckets[LATENCY_BUCKETS];
+} __attribute__((aligned(CACHELINE)));
+
+/*
+ * Counters of one client. A slot keeps counting for the next client that
+ * takes it, so sums over the slots never go backwards; a client reports
+ * what its slot counted since it took it.
+ */
+struct metrics_client {
+  /* 0 free, 1 being taken, 2 in use; gen changes with every client */
+  int state;
+  unsigned int gen;
+  struct sockaddr_in addr;
+  unsigned long bytes;
+  unsigned long frames;
+  unsigned long skipped;
+  unsigned long bytes0, frames0, skipped0;
+} __attribute__((aligned(CACHELINE)));
+
+/*
+ * Every stage writes its own counters with relaxed atomics, nothing on the
+ * hot path takes a lock. Counters kept by other modules (driver errors,
+ * encoder queue, viewers) are only read when the metrics are collected.
+ */
+struct metrics {
+  /* capture thread */
+  unsigned long captured __attribute__((aligned(CACHELINE)));
+  time_t fps_sec;
+  unsigned int fps_count;
+  unsigned int fps;
+  /* encoder thread */
+  unsigned long encoded __attribute__((aligned(CACHELINE)));
+  unsigned long encode_errors;
+  unsigned long encode_usec;
+  unsigned long encode_hist[METRICS_BUCKETS + 1];
+  struct latency_hist latency[LATENCY_STAGES];
+  /* clients */
+  int clients __attribute__((aligned(CACHELINE)));
+  unsigned long connections;
+  struct metrics_client others;
+  struct metrics_client slots[METRICS_CLIENTS];
+  /* set up once by main() */
+  struct vdIn *vd;
+  struct spsc_queue *queue;
+  struct frame_ring *ring;
+  struct frame_ring *live;
+  struct rec_queue *recq;
+};
+
+extern struct metrics metrics;
+
+void metrics_captured(void);
+void metrics_encoded(const struct frame_times *t, int ok);
+void metrics_latency(enum latency_stage stage, uint64_t from, uint64_t to);
+void metrics_frame_sent(const struct frame *f);
+
+struct metrics_client *metrics_client_open(struct sockaddr_in *addr);
+void metrics_client_close(struct metrics_client *mc);
+void metrics_sent(struct metrics_client *mc, int bytes, int frames);
+void metrics_skipped(struct metrics_client *mc, unsigned int frames);
+
+struct frame *metrics_frame(void);
+int metrics_latency_print(char *buf, int size);
+struct frame *metrics_latency_frame(void);
+
+#endif
@@ -0,0 +1,266 @@
+/*  pixel format conversion kernels
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#include <stdio.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXCONV_X86
+#include <immintrin.h>
+#endif
+
+#include "pixconv.h"
+
+/*
+ * Scalar reference versions, also used for the tail of a line the vector
+ * loops do not cover.
+ */
+static void yuyv_split_c(const unsigned char *yuyv, unsigned char *y,
+                         unsigned char *u, unsigned char *v, int width)
+{
+  int x;
+
+  for (x = 0; x < width / 2; x++) {
+    y[2 * x] = yuyv[0];
+    y[2 * x + 1] = yuyv[2];
+    u[x] = yuyv[1];
+    v[x] = yuyv[3];
+    yuyv += 4;
+  }
+}
+
+static void yuyv_split_avg_c(const unsigned char *yuyv, unsigned char *y,
+                             unsigned char *u, unsigned char *v, int width)
+{
+  int x;
+
+  for (x = 0; x < width / 2; x++) {
+    y[2 * x] = yuyv[0];
+    y[2 * x + 1] = yuyv[2];
+    u[x] = (u[x] + yuyv[1] + 1) >> 1;
+    v[x] = (v[x] + yuyv[3] + 1) >> 1;
+    yuyv += 4;
+  }
+}
+
+/* every 4 sensor bytes give 4 identical pixels, green is the truncated mean */
+static void rggb_to_rgb_c(const unsigned char *rggb, unsigned char *rgb, int width)
+{
+  int x, r, g, b;
+
+  for (x = 0; x < width; x++) {
+    r = rggb[0];
+    g = (rggb[1] + rggb[2]) / 2;
+    b = rggb[3];
+
+    *(rgb++) = r;
+    *(rgb++) = g;
+    *(rgb++) = b;
+
+    if ((x & 3) == 3) {
+      rggb += 4;
+    }
+  }
+}
+
+#ifdef PIXCONV_X86
+
+/* 32 pixels per round: y gets the even bytes, u and v the odd ones */
+#define YUYV_SPLIT_SSE2(avg)                                                  \
+  const __m128i lo = _mm_set1_epi16(0x00ff);                                  \
+  __m128i a, b, c, d, uv0, uv1, uu, vv;                                       \
+  int x;                                                                      \
+                                                                              \
+  for (x = 0; x + 32 <= width; x += 32) {                                     \
+    a = _mm_loadu_si128((const __m128i *)(yuyv + 2 * x));                     \
+    b = _mm_loadu_si128((const __m128i *)(yuyv + 2 * x + 16));                \
+    c = _mm_loadu_si128((const __m128i *)(yuyv + 2 * x + 32));               \
+    d = _mm_loadu_si128((const __m128i *)(yuyv + 2 * x + 48));               \
+                                                                              \
+    _mm_storeu_si128((__m128i *)(y + x),                                      \
+      _mm_packus_epi16(_mm_and_si128(a, lo), _mm_and_si128(b, lo)));          \
+    _mm_storeu_si128((__m128i *)(y + x + 16),                                 \
+      _mm_packus_epi16(_mm_and_si128(c, lo), _mm_and_si128(d, lo)));          \
+                                                                              \
+    uv0 = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));       \
+    uv1 = _mm_packus_epi16(_mm_srli_epi16(c, 8), _mm_srli_epi16(d, 8));       \
+    uu = _mm_packus_epi16(_mm_and_si128(uv0, lo), _mm_and_si128(uv1, lo));    \
+    vv = _mm_packus_epi16(_mm_srli_epi16(uv0, 8), _mm_srli_epi16(uv1, 8));    \
+    if (avg) {                                                                \
+      uu = _mm_avg_epu8(uu, _mm_loadu_si128((const __m128i *)(u + x / 2)));   \
+      vv = _mm_avg_epu8(vv, _mm_loadu_si128((const __m128i *)(v + x / 2)));   \
+    }                                                                         \
+    _mm_storeu_si128((__m128i *)(u + x / 2), uu);                             \
+    _mm_storeu_si128((__m128i *)(v + x / 2), vv);                             \
+  }
+
+__attribute__((target("sse2")))
+static void yuyv_split_sse2(const unsigned char *yuyv, unsigned char *y,
+                            unsigned char *u, unsigned char *v, int width)
+{
+  YUYV_SPLIT_SSE2(0)
+  yuyv_split_c(yuyv + 2 * x, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_split_avg_sse2(const unsigned char *yuyv, unsigned char *y,
+                                unsigned char *u, unsigned char *v, int width)
+{
+  YUYV_SPLIT_SSE2(1)
+  yuyv_split_avg_c(yuyv + 2 * x, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+/*
+ * 64 pixels per round. The AVX2 pack instructions work on each 128 bit
+ * half, the 64 bit quarters are put back in order with a permute.
+ */
+#define YUYV_SPLIT_AVX2(avg)                                                  \
+  const __m256i lo = _mm256_set1_epi16(0x00ff);                               \
+  __m256i a, b, c, d, uv0, uv1, uu, vv;                                       \
+  int x;                                                                      \
+                                                                              \
+  for (x = 0; x + 64 <= width; x += 64) {                                     \
+    a = _mm256_loadu_si256((const __m256i *)(yuyv + 2 * x));                  \
+    b = _mm256_loadu_si256((const __m256i *)(yuyv + 2 * x + 32));             \
+    c = _mm256_loadu_si256((const __m256i *)(yuyv + 2 * x + 64));             \
+    d = _mm256_loadu_si256((const __m256i *)(yuyv + 2 * x + 96));             \
+                                                                              \
+    _mm256_storeu_si256((__m256i *)(y + x), _mm256_permute4x64_epi64(        \
+      _mm256_packus_epi16(_mm256_and_si256(a, lo), _mm256_and_si256(b, lo)),  \
+      0xd8));                                                                 \
+    _mm256_storeu_si256((__m256i *)(y + x + 32), _mm256_permute4x64_epi64(   \
+      _mm256_packus_epi16(_mm256_and_si256(c, lo), _mm256_and_si256(d, lo)),  \
+      0xd8));                                                                 \
+                                                                              \
+    uv0 = _mm256_permute4x64_epi64(_mm256_packus_epi16(                       \
+      _mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8)), 0xd8);               \
+    uv1 = _mm256_permute4x64_epi64(_mm256_packus_epi16(                       \
+      _mm256_srli_epi16(c, 8), _mm256_srli_epi16(d, 8)), 0xd8);               \
+    uu = _mm256_permute4x64_epi64(_mm256_packus_epi16(                        \
+      _mm256_and_si256(uv0, lo), _mm256_and_si256(uv1, lo)), 0xd8);           \
+    vv = _mm256_permute4x64_epi64(_mm256_packus_epi16(                        \
+      _mm256_srli_epi16(uv0, 8), _mm256_srli_epi16(uv1, 8)), 0xd8);           \
+    if (avg) {                                                                \
+      uu = _mm256_avg_epu8(uu,                                                \
+             _mm256_loadu_si256((const __m256i *)(u + x / 2)));               \
+      vv = _mm256_avg_epu8(vv,                                                \
+             _mm256_loadu_si256((const __m256i *)(v + x / 2)));               \
+    }                                                                         \
+    _mm256_storeu_si256((__m256i *)(u + x / 2), uu);                          \
+    _mm256_storeu_si256((__m256i *)(v + x / 2), vv);                          \
+  }
+
+__attribute__((target("avx2")))
+static void yuyv_split_avx2(const unsigned char *yuyv, unsigned char *y,
+                            unsigned char *u, unsigned char *v, int width)
+{
+  YUYV_SPLIT_AVX2(0)
+  yuyv_split_c(yuyv + 2 * x, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_split_avg_avx2(const unsigned char *yuyv, unsigned char *y,
+                                unsigned char *u, unsigned char *v, int width)
+{
+  YUYV_SPLIT_AVX2(1)
+  yuyv_split_avg_c(yuyv + 2 * x, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+/*
+ * 16 pixels (4 sensor groups) per round. The (a + b) / 2 of the reference
+ * is the rounding average minus the lost low bit. Each group is then
+ * spread to 12 output bytes with a byte shuffle.
+ */
+__attribute__((target("avx2")))
+static void rggb_to_rgb_avx2(const unsigned char *rggb, unsigned char *rgb, int width)
+{
+  const __m128i one = _mm_set1_epi8(1);
+  const __m128i g1 = _mm_setr_epi8(1, -1, -1, -1, 5, -1, -1, -1, 9, -1, -1, -1, 13, -1, -1, -1);
+  const __m128i g2 = _mm_setr_epi8(2, -1, -1, -1, 6, -1, -1, -1, 10, -1, -1, -1, 14, -1, -1, -1);
+  /* r, g, b of group n are bytes 4n, 4n + 1, 4n + 3 after g replaced byte 4n + 1 */
+  const __m128i s0 = _mm_setr_epi8(0, 1, 3, 0, 1, 3, 0, 1, 3, 0, 1, 3, 4, 5, 7, 4);
+  const __m128i s1 = _mm_setr_epi8(5, 7, 4, 5, 7, 4, 5, 7, 8, 9, 11, 8, 9, 11, 8, 9);
+  const __m128i s2 = _mm_setr_epi8(11, 8, 9, 11, 12, 13, 15, 12, 13, 15, 12, 13, 15, 12, 13, 15);
+  __m128i p, a, b, g;
+  int x;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    p = _mm_loadu_si128((const __m128i *)(rggb + x));
+    a = _mm_shuffle_epi8(p, g1);
+    b = _mm_shuffle_epi8(p, g2);
+    g = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    /* g sits in byte 4n, move it to 4n + 1 over the first green */
+    p = _mm_or_si128(_mm_andnot_si128(_mm_set1_epi32(0x0000ff00), p), _mm_slli_epi32(g, 8));
+
+    _mm_storeu_si128((__m128i *)(rgb + 3 * x), _mm_shuffle_epi8(p, s0));
+    _mm_storeu_si128((__m128i *)(rgb + 3 * x + 16), _mm_shuffle_epi8(p, s1));
+    _mm_storeu_si128((__m128i *)(rgb + 3 * x + 32), _mm_shuffle_epi8(p, s2));
+  }
+  rggb_to_rgb_c(rggb + x, rgb + 3 * x, width - x);
+}
+
+#endif /* PIXCONV_X86 */
+
+static const struct pixconv pixconv_scalar = {
+  "scalar", yuyv_split_c, yuyv_split_avg_c, rggb_to_rgb_c
+};
+
+#ifdef PIXCONV_X86
+/* spreading the RGGB groups takes a byte shuffle, SSE2 has none: scalar */
+static const struct pixconv pixconv_sse2 = {
+  "sse2", yuyv_split_sse2, yuyv_split_avg_sse2, rggb_to_rgb_c
+};
+
+static const struct pixconv pixconv_avx2 = {
+  "avx2", yuyv_split_avx2, yuyv_split_avg_avx2, rggb_to_rgb_avx2
+};
+#endif
+
+struct pixconv pixconv = {
+  "scalar", yuyv_split_c, yuyv_split_avg_c, rggb_to_rgb_c
+};
+
+static pthread_once_t pixconv_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Every variant this CPU can run, the scalar reference first and the best
+ * one last. Returns how many were put in list.
+ */
+int pixconv_variants(const struct pixconv **list, int max)
+{
+  int n = 0;
+
+  if (n < max) {
+    list[n++] = &pixconv_scalar;
+  }
+#ifdef PIXCONV_X86
+  __builtin_cpu_init();
+  if (n < max && __builtin_cpu_supports("sse2")) {
+    list[n++] = &pixconv_sse2;
+  }
+  if (n < max && __builtin_cpu_supports("avx2")) {
+    list[n++] = &pixconv_avx2;
+  }
+#endif
+  return n;
+}
+
+static void pixconv_select(void)
+{
+  const struct pixconv *list[PIXCONV_VARIANTS];
+
+  pixconv = *list[pixconv_variants(list, PIXCONV_VARIANTS) - 1];
+}
+
+/* pick the conversion routines for this CPU, safe to call more than once */
+void pixconv_init(void)
+{
+  pthread_once(&pixconv_once, pixconv_select);
+}
@@ -0,0 +1,39 @@
+/*  pixel format conversion kernels
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#ifndef _PIXCONV_H
+#define _PIXCONV_H
+
+/*
+ * Line conversion routines used by the JPEG encoder. All variants give
+ * exactly the same output as the scalar ones, the best one for the CPU
+ * is picked once by pixconv_init().
+ */
+struct pixconv {
+  const char *name;
+  /* split a YUYV line into Y, Cb and Cr, width is in pixels */
+  void (*yuyv_split)(const unsigned char *yuyv, unsigned char *y,
+                     unsigned char *u, unsigned char *v, int width);
+  /* same, but average the chroma with what is already in u and v (4:2:0) */
+  void (*yuyv_split_avg)(const unsigned char *yuyv, unsigned char *y,
+                         unsigned char *u, unsigned char *v, int width);
+  /* RGGB line to packed RGB24 */
+  void (*rggb_to_rgb)(const unsigned char *rggb, unsigned char *rgb, int width);
+};
+
+/* most variants one CPU can run */
+#define PIXCONV_VARIANTS  3
+
+extern struct pixconv pixconv;
+
+void pixconv_init(void);
+int pixconv_variants(const struct pixconv **list, int max);
+
+#endif
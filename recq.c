@@ -0,0 +1,153 @@
+/*  recorder queue, published frames on their way to disk
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "recq.h"
+
+#define ENTRY_SIZE      sizeof(struct rec_entry)
+/* room an entry with its data takes, entries stay aligned */
+#define ENTRY_SPAN(n)   (ENTRY_SIZE + (((size_t)(n) + ENTRY_SIZE - 1) & ~(ENTRY_SIZE - 1)))
+
+/* budget is rounded down to whole entries */
+int recq_init(struct rec_queue *q, size_t budget)
+{
+  memset(q, 0, sizeof(struct rec_queue));
+  q->size = budget & ~(ENTRY_SIZE - 1);
+  q->buf = (unsigned char *)malloc(q->size);
+  if (q->size < 2 * ENTRY_SIZE || q->buf == NULL) {
+    free(q->buf);
+    return -1;
+  }
+  if (sem_init(&q->avail, 0, 0) < 0) {
+    perror("sem_init");
+    free(q->buf);
+    return -1;
+  }
+  return 0;
+}
+
+/* capture side, f takes the next sequence number */
+void recq_number(struct rec_queue *q, struct frame *f)
+{
+  f->seq = q->seq;
+  __atomic_store_n(&q->seq, q->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * A numbered frame is dropped before it is published, from any thread. Its
+ * sequence number stays used up, the recorder fills the gap.
+ */
+void recq_skip(struct rec_queue *q)
+{
+  __atomic_add_fetch(&q->skipped, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Producer side, copy the picture of f into the queue. Returns -1 and
+ * counts a drop if the budget has no room for it, the sequence number of
+ * f is used up either way.
+ */
+int recq_push(struct rec_queue *q, const struct frame *f)
+{
+  unsigned long head = q->head;
+  unsigned long used = head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+  size_t pos = head % q->size;
+  size_t need = ENTRY_SPAN(f->size);
+  size_t skip = (pos + need > q->size) ? q->size - pos : 0;
+  struct rec_entry *e;
+
+  if (used + skip + need > q->size) {
+    __atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  /* an entry does not wrap around, the rest of the buffer is marked unused */
+  if (skip) {
+    e = (struct rec_entry *)(q->buf + pos);
+    e->size = -1;
+    head += skip;
+    pos = 0;
+  }
+
+  e = (struct rec_entry *)(q->buf + pos);
+  e->seq = f->seq;
+  e->size = f->size;
+  memcpy(e + 1, f->buff, f->size);
+
+  __atomic_store_n(&q->head, head + need, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&q->queued, 1, __ATOMIC_RELAXED);
+  if (used + skip + need > q->max_used) {
+    __atomic_store_n(&q->max_used, used + skip + need, __ATOMIC_RELAXED);
+  }
+
+  sem_post(&q->avail);
+  return 0;
+}
+
+/*
+ * Consumer side, wait for the oldest entry and return it without taking it
+ * out of the queue. Once the queue is closed, what is left is returned and
+ * then NULL.
+ */
+struct rec_entry *recq_peek(struct rec_queue *q)
+{
+  struct rec_entry *e;
+  size_t pos;
+
+  for (;;) {
+    if (q->tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+      pos = q->tail % q->size;
+      e = (struct rec_entry *)(q->buf + pos);
+      if (e->size >= 0) {
+        return e;
+      }
+      __atomic_store_n(&q->tail, q->tail + q->size - pos, __ATOMIC_RELEASE);
+      continue;
+    }
+    if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+      return NULL;
+    }
+    if (sem_wait(&q->avail) < 0 && errno != EINTR) {
+      perror("sem_wait");
+      return NULL;
+    }
+  }
+}
+
+/* consumer side, the entry from recq_peek() has been written, free its room */
+void recq_pop(struct rec_queue *q, struct rec_entry *e)
+{
+  __atomic_store_n(&q->tail, q->tail + ENTRY_SPAN(e->size), __ATOMIC_RELEASE);
+  __atomic_add_fetch(&q->written, 1, __ATOMIC_RELAXED);
+}
+
+/* bytes of the budget in use */
+unsigned long recq_used(struct rec_queue *q)
+{
+  return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+/* the consumer gets what is still queued, then NULL from recq_peek() */
+void recq_close(struct rec_queue *q)
+{
+  __atomic_store_n(&q->closed, 1, __ATOMIC_RELEASE);
+  sem_post(&q->avail);
+}
+
+void recq_destroy(struct rec_queue *q)
+{
+  sem_destroy(&q->avail);
+  free(q->buf);
+  q->buf = NULL;
+}
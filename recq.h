@@ -0,0 +1,69 @@
+/*  recorder queue, published frames on their way to disk
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#ifndef _RECQ_H
+#define _RECQ_H
+
+#include <stddef.h>
+#include <semaphore.h>
+
+#include "frame.h"
+
+#ifndef CACHELINE
+#define CACHELINE   64
+#endif
+
+/* a frame in the queue, its data follows right after the entry */
+struct rec_entry {
+  /* sequence number among all frames captured while recording */
+  unsigned int seq;
+  /* bytes of data, -1 marks the unused end of the buffer */
+  int size;
+} __attribute__((aligned(16)));
+
+/*
+ * Frames are copied into a byte ring of a fixed budget, so the recorder
+ * holds on to no frame buffers and a slow disk can only use up the budget.
+ * Every captured frame gets a sequence number; one that does not fit, or
+ * is dropped before it is published, is counted and the recorder sees the
+ * gap. One producer (the thread that publishes frames), one consumer (the
+ * recorder).
+ */
+struct rec_queue {
+  /* written by the capture thread only */
+  unsigned int seq;
+  /* captured frames that never got to the queue */
+  unsigned long skipped;
+  /* written by the producer only, byte offsets never wrap the buffer */
+  unsigned long head __attribute__((aligned(CACHELINE)));
+  unsigned long queued;
+  unsigned long dropped;
+  unsigned long max_used;
+  /* written by the consumer only */
+  unsigned long tail __attribute__((aligned(CACHELINE)));
+  unsigned long written;
+  /* read only after init */
+  unsigned char *buf __attribute__((aligned(CACHELINE)));
+  size_t size;
+  int closed;
+  sem_t avail;
+};
+
+int recq_init(struct rec_queue *q, size_t budget);
+void recq_number(struct rec_queue *q, struct frame *f);
+void recq_skip(struct rec_queue *q);
+int recq_push(struct rec_queue *q, const struct frame *f);
+struct rec_entry *recq_peek(struct rec_queue *q);
+void recq_pop(struct rec_queue *q, struct rec_entry *e);
+unsigned long recq_used(struct rec_queue *q);
+void recq_close(struct rec_queue *q);
+void recq_destroy(struct rec_queue *q);
+
+#endif
@@ -0,0 +1,324 @@
+/*  single producer / multi consumer frame ring
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "ring.h"
+
+#define RING_MASK (RING_SLOTS - 1)
+
+void ring_init(struct frame_ring *ring)
+{
+  memset(ring, 0, sizeof(struct frame_ring));
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->viewer_cond, NULL);
+  ring->consumers = NULL;
+}
+
+static void ring_wake(struct frame_ring *ring, int all)
+{
+  struct ring_consumer *c;
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&ring->lock);
+  for (c = ring->consumers; c; c = c->next) {
+    if (__atomic_exchange_n(&c->waiting, 0, __ATOMIC_SEQ_CST) || all) {
+      if (write(c->efd, &one, sizeof(one)) < 0) {
+        perror("eventfd write");
+      }
+    }
+  }
+  pthread_mutex_unlock(&ring->lock);
+}
+
+/* only called from the camera thread, the reference of the caller is passed to the ring */
+void ring_publish(struct frame_ring *ring, struct frame *f)
+{
+  unsigned int head = ring->head + 1;
+  struct ring_slot *slot;
+  struct frame *old;
+  unsigned int s;
+
+  /* 0 means "nothing published yet" */
+  if (head == 0) {
+    head = 1;
+  }
+
+  slot = &ring->slots[head & RING_MASK];
+  old = slot->frame;
+  s = slot->seq;
+
+  __atomic_store_n(&slot->seq, s + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&slot->head, head, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->frame, f, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->seq, s + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&ring->stale, 0, __ATOMIC_RELEASE);
+
+  /* the last reference may requeue a V4L2 buffer */
+  frame_unref(old);
+
+  ring_wake(ring, 0);
+}
+
+/* sequence number of the latest published frame */
+unsigned int ring_head(struct frame_ring *ring)
+{
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Return a reference to the latest frame or NULL if there is none yet,
+ * its sequence number is stored in seq unless that is NULL.
+ * Frames are never freed while the ring is in use (they go back to their
+ * pool or the driver), so taking a reference to a frame that was replaced
+ * meanwhile is harmless, the slot sequence check catches it.
+ */
+struct frame *ring_latest(struct frame_ring *ring, unsigned int *seq)
+{
+  struct ring_slot *slot;
+  struct frame *f;
+  unsigned int head, s1, s2;
+
+  for (;;) {
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == 0) {
+      return NULL;
+    }
+
+    slot = &ring->slots[head & RING_MASK];
+    s1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (s1 & 1) {
+      continue;
+    }
+
+    f = __atomic_load_n(&slot->frame, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&slot->head, __ATOMIC_RELAXED);
+    if (f == NULL || frame_tryref(f) == NULL) {
+      continue;
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    s2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    if (s1 == s2) {
+      if (seq) {
+        *seq = head;
+      }
+      return f;
+    }
+    frame_unref(f);
+  }
+}
+
+/* register a consumer, it will only see frames published from now on */
+int ring_attach(struct frame_ring *ring, struct ring_consumer *c)
+{
+  c->efd = eventfd(0, EFD_CLOEXEC);
+  if (c->efd < 0) {
+    perror("eventfd");
+    return -1;
+  }
+  c->waiting = 0;
+  c->seq = ring_head(ring);
+
+  pthread_mutex_lock(&ring->lock);
+  c->next = ring->consumers;
+  ring->consumers = c;
+  pthread_mutex_unlock(&ring->lock);
+  return 0;
+}
+
+void ring_detach(struct frame_ring *ring, struct ring_consumer *c)
+{
+  struct ring_consumer **pc;
+
+  pthread_mutex_lock(&ring->lock);
+  for (pc = &ring->consumers; *pc; pc = &(*pc)->next) {
+    if (*pc == c) {
+      *pc = c->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&ring->lock);
+
+  close(c->efd);
+  c->efd = -1;
+}
+
+/*
+ * Wait for a frame newer than the last one this consumer has seen and
+ * return a reference to the latest one. Returns NULL once stopped.
+ */
+struct frame *ring_wait(struct frame_ring *ring, struct ring_consumer *c)
+{
+  struct frame *f;
+  uint64_t v;
+
+  while (!__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE)) {
+    if (ring_head(ring) != c->seq) {
+      f = ring_latest(ring, &c->seq);
+      if (f) {
+        return f;
+      }
+    }
+
+    /* announce we sleep, then check again so a publish can not slip through */
+    __atomic_store_n(&c->waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != c->seq ||
+        __atomic_load_n(&ring->stop, __ATOMIC_SEQ_CST)) {
+      __atomic_store_n(&c->waiting, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    if (read(c->efd, &v, sizeof(v)) < 0 && errno != EINTR) {
+      perror("eventfd read");
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * For consumers that poll the eventfd with select/epoll instead of calling
+ * ring_wait(): request a wakeup for the next frame. Returns 1 if a frame
+ * newer than c->seq is already there and there is no point in sleeping.
+ */
+int ring_arm(struct frame_ring *ring, struct ring_consumer *c)
+{
+  __atomic_store_n(&c->waiting, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != c->seq ||
+      __atomic_load_n(&ring->stop, __ATOMIC_SEQ_CST)) {
+    __atomic_store_n(&c->waiting, 0, __ATOMIC_RELAXED);
+    return 1;
+  }
+  return 0;
+}
+
+/* the producer made more of a live frame ready, wake whoever waits for it */
+void ring_progress(struct frame_ring *ring)
+{
+  ring_wake(ring, 0);
+}
+
+/* more than "sent" bytes of f are there, or it is complete */
+static int ring_data_ready(struct frame *f, int sent)
+{
+  return __atomic_load_n(&f->done, __ATOMIC_SEQ_CST) ||
+         __atomic_load_n(&f->ready, __ATOMIC_SEQ_CST) > sent;
+}
+
+/*
+ * Sleep until f, a live frame, has more than "sent" bytes ready or is done.
+ * Returns 0 then, -1 once the ring is stopped.
+ */
+int ring_wait_data(struct frame_ring *ring, struct ring_consumer *c, struct frame *f, int sent)
+{
+  uint64_t v;
+
+  while (!__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE)) {
+    if (ring_arm_data(ring, c, f, sent)) {
+      return 0;
+    }
+    if (read(c->efd, &v, sizeof(v)) < 0 && errno != EINTR) {
+      perror("eventfd read");
+      return -1;
+    }
+  }
+  return -1;
+}
+
+/* like ring_arm(), returns 1 if there is no need to sleep for data of f */
+int ring_arm_data(struct frame_ring *ring, struct ring_consumer *c, struct frame *f, int sent)
+{
+  if (ring_data_ready(f, sent)) {
+    return 1;
+  }
+  __atomic_store_n(&c->waiting, 1, __ATOMIC_SEQ_CST);
+  if (ring_data_ready(f, sent) || __atomic_load_n(&ring->stop, __ATOMIC_SEQ_CST)) {
+    __atomic_store_n(&c->waiting, 0, __ATOMIC_RELAXED);
+    return 1;
+  }
+  return 0;
+}
+
+/* a client starts (n = 1) or stops (n = -1) wanting frames */
+void ring_viewers_add(struct frame_ring *ring, int n)
+{
+  if (__atomic_add_fetch(&ring->viewers, n, __ATOMIC_SEQ_CST) == n && n > 0) {
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_broadcast(&ring->viewer_cond);
+    pthread_mutex_unlock(&ring->lock);
+  }
+}
+
+int ring_viewers(struct frame_ring *ring)
+{
+  return __atomic_load_n(&ring->viewers, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Asked by the producer before it prepares a frame, returns 1 if nobody
+ * wants it. The latest frame is marked stale before the second look, so
+ * a new viewer either sees the mark or is seen here.
+ */
+int ring_idle(struct frame_ring *ring)
+{
+  if (ring_viewers(ring) > 0) {
+    return 0;
+  }
+  __atomic_store_n(&ring->stale, 1, __ATOMIC_SEQ_CST);
+  return ring_viewers(ring) == 0;
+}
+
+/* check after ring_viewers_add(), a stale frame is not worth sending */
+int ring_stale(struct frame_ring *ring)
+{
+  return __atomic_load_n(&ring->stale, __ATOMIC_SEQ_CST);
+}
+
+/* sleep until there is a viewer or the ring is stopped */
+void ring_wait_viewers(struct frame_ring *ring)
+{
+  pthread_mutex_lock(&ring->lock);
+  while (__atomic_load_n(&ring->viewers, __ATOMIC_SEQ_CST) <= 0 &&
+         !__atomic_load_n(&ring->stop, __ATOMIC_SEQ_CST)) {
+    pthread_cond_wait(&ring->viewer_cond, &ring->lock);
+  }
+  pthread_mutex_unlock(&ring->lock);
+}
+
+void ring_stop(struct frame_ring *ring)
+{
+  __atomic_store_n(&ring->stop, 1, __ATOMIC_SEQ_CST);
+  ring_wake(ring, 1);
+  pthread_mutex_lock(&ring->lock);
+  pthread_cond_broadcast(&ring->viewer_cond);
+  pthread_mutex_unlock(&ring->lock);
+}
+
+void ring_destroy(struct frame_ring *ring)
+{
+  int i;
+
+  for (i = 0; i < RING_SLOTS; i++) {
+    frame_unref(ring->slots[i].frame);
+    ring->slots[i].frame = NULL;
+  }
+  pthread_cond_destroy(&ring->viewer_cond);
+  pthread_mutex_destroy(&ring->lock);
+}
@@ -0,0 +1,81 @@
+/*  single producer / multi consumer frame ring
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#ifndef _RING_H
+#define _RING_H
+
+#include <pthread.h>
+
+#include "frame.h"
+
+#define RING_SLOTS  2  /* power of two, keep below NB_BUFFER - MIN_QUEUED */
+#ifndef CACHELINE
+#define CACHELINE   64
+#endif
+
+/*
+ * Every slot is a small seqlock: the producer makes slot->seq odd while it
+ * swaps the frame pointer, readers retry when it changed under them.
+ */
+struct ring_slot {
+  unsigned int seq;
+  /* ring->head the frame was published as, a frame can sit in two rings */
+  unsigned int head;
+  struct frame *frame;
+} __attribute__((aligned(CACHELINE)));
+
+/*
+ * A consumer tracks its own read position and sleeps on its own eventfd,
+ * the producer only writes to the eventfds of consumers that are waiting.
+ */
+struct ring_consumer {
+  unsigned int seq;
+  int waiting;
+  int efd;
+  struct ring_consumer *next;
+} __attribute__((aligned(CACHELINE)));
+
+struct frame_ring {
+  unsigned int head __attribute__((aligned(CACHELINE)));
+  int stop;
+  /* set while the producer skips frames, the latest one is outdated then */
+  int stale;
+  struct ring_slot slots[RING_SLOTS];
+  /* clients that want frames, the producer idles while there are none */
+  int viewers __attribute__((aligned(CACHELINE)));
+  /* consumer list, only taken on attach/detach and to wake sleepers */
+  pthread_mutex_t lock __attribute__((aligned(CACHELINE)));
+  pthread_cond_t viewer_cond;
+  struct ring_consumer *consumers;
+};
+
+void ring_init(struct frame_ring *ring);
+void ring_publish(struct frame_ring *ring, struct frame *f);
+unsigned int ring_head(struct frame_ring *ring);
+struct frame *ring_latest(struct frame_ring *ring, unsigned int *seq);
+
+int ring_attach(struct frame_ring *ring, struct ring_consumer *c);
+void ring_detach(struct frame_ring *ring, struct ring_consumer *c);
+struct frame *ring_wait(struct frame_ring *ring, struct ring_consumer *c);
+int ring_arm(struct frame_ring *ring, struct ring_consumer *c);
+void ring_progress(struct frame_ring *ring);
+int ring_wait_data(struct frame_ring *ring, struct ring_consumer *c, struct frame *f, int sent);
+int ring_arm_data(struct frame_ring *ring, struct ring_consumer *c, struct frame *f, int sent);
+
+void ring_viewers_add(struct frame_ring *ring, int n);
+int ring_viewers(struct frame_ring *ring);
+int ring_idle(struct frame_ring *ring);
+int ring_stale(struct frame_ring *ring);
+void ring_wait_viewers(struct frame_ring *ring);
+
+void ring_stop(struct frame_ring *ring);
+void ring_destroy(struct frame_ring *ring);
+
+#endif
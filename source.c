@@ -0,0 +1,157 @@
+/*  frame sources: V4L2 camera, synthetic test pattern, AVI replay
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "v4l2uvc.h"
+#include "source.h"
+
+/*
+ * The backend is picked by the device name: "synth" is the test pattern,
+ * a name ending in ".avi" is replayed, anything else is a V4L2 device.
+ */
+static const struct frame_source_ops *source_backend(const char *device)
+{
+  size_t len = strlen(device);
+
+  if (!strncmp(device, "synth", 5)) {
+    return &source_synth;
+  }
+  if (len > 4 && !strcasecmp(device + len - 4, ".avi")) {
+    return &source_replay;
+  }
+  return &source_v4l2;
+}
+
+/*
+ * Open the source for "device", vd is filled with the picture parameters
+ * (a replayed file has its own size). Returns -1 on failure.
+ */
+int source_open(struct frame_source *src, struct vdIn *vd, const char *device,
+                int width, int height, int fps, int format)
+{
+  src->ops = source_backend(device);
+  src->vd = vd;
+  src->next.tv_sec = 0;
+  src->next.tv_nsec = 0;
+  src->priv = NULL;
+
+  vd->width = width;
+  vd->height = height;
+  vd->fps = fps;
+  vd->formatIn = format;
+  vd->framesizeIn = width * height * 2;
+
+  return src->ops->open(src, device);
+}
+
+int source_grab(struct frame_source *src, struct frame_pool *pool, struct frame **out)
+{
+  return src->ops->grab(src, pool, out);
+}
+
+int source_release(struct frame_source *src)
+{
+  return src->ops->release(src);
+}
+
+void source_close(struct frame_source *src)
+{
+  src->ops->close(src);
+}
+
+/*
+ * Sleep until the next picture is due at vd->fps, 0 means as fast as
+ * possible. A source that fell behind by a whole period starts over from
+ * now instead of catching up with a burst.
+ */
+void source_pace(struct frame_source *src)
+{
+  struct timespec now;
+  long period;
+
+  if (src->vd->fps <= 0) {
+    return;
+  }
+  period = 1000000000L / src->vd->fps;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (src->next.tv_sec == 0 ||
+      (now.tv_sec - src->next.tv_sec) * 1000000000L + now.tv_nsec - src->next.tv_nsec > period) {
+    src->next = now;
+  }
+  else {
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &src->next, NULL);
+  }
+
+  src->next.tv_nsec += period;
+  while (src->next.tv_nsec >= 1000000000L) {
+    src->next.tv_nsec -= 1000000000L;
+    src->next.tv_sec++;
+  }
+}
+
+static int v4l2_open(struct frame_source *src, const char *device)
+{
+  struct vdIn *vd = src->vd;
+
+  return init_videoIn(vd, (char *)device, vd->width, vd->height, vd->fps, vd->formatIn, 1);
+}
+
+/* mmap buffers for zero copy, otherwise a copy of the picture in a pool frame */
+static int v4l2_grab(struct frame_source *src, struct frame_pool *pool, struct frame **out)
+{
+  struct vdIn *vd = src->vd;
+  struct frame *f;
+  int ret;
+
+  if (src->zero_copy) {
+    ret = uvcGrabFrame(vd, pool, out);
+  }
+  else {
+    *out = NULL;
+    ret = uvcGrab(vd);
+    if (ret == 0) {
+      f = frame_pool_get(pool);
+      if (f == NULL) {
+        return -1;
+      }
+      f->size = (vd->framesizeIn > f->capacity) ? f->capacity : vd->framesizeIn;
+      f->times.driver = uvcBufferTime(&vd->buf);
+      memcpy(f->buff, vd->tmpbuffer, f->size);
+      *out = f;
+    }
+  }
+
+  /* only use usleep if the fps is below 5, otherwise the overhead is too long */
+  if (ret == 0 && vd->fps < 5) {
+    usleep(1000*1000/vd->fps);
+  }
+  return ret;
+}
+
+static int v4l2_release(struct frame_source *src)
+{
+  return uvcStreamOff(src->vd);
+}
+
+static void v4l2_close(struct frame_source *src)
+{
+  close_v4l2(src->vd);
+}
+
+const struct frame_source_ops source_v4l2 = {
+  "V4L2", v4l2_open, v4l2_grab, v4l2_release, v4l2_close
+};
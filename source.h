@@ -0,0 +1,59 @@
+/*  frame sources: V4L2 camera, synthetic test pattern, AVI replay
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#ifndef _SOURCE_H
+#define _SOURCE_H
+
+#include <time.h>
+
+#include "frame.h"
+
+struct vdIn;
+
+struct frame_source;
+
+/*
+ * A backend delivers pictures of the size, format and rate described by
+ * src->vd. Frames handed out by grab() are references, they go back to
+ * the backend (driver queue or pool) through frame_unref().
+ */
+struct frame_source_ops {
+  const char *name;
+  int (*open)(struct frame_source *src, const char *device);
+  /* next picture in *out, NULL for a picture to skip; -1 on error */
+  int (*grab)(struct frame_source *src, struct frame_pool *pool, struct frame **out);
+  /* let go of the device while nobody watches, the next grab resumes */
+  int (*release)(struct frame_source *src);
+  void (*close)(struct frame_source *src);
+};
+
+struct frame_source {
+  const struct frame_source_ops *ops;
+  /* picture size, format and rate; the V4L2 device state for the camera */
+  struct vdIn *vd;
+  /* hand out mmap buffers of the camera instead of copies */
+  int zero_copy;
+  /* synthetic and replay sources keep their own pace */
+  struct timespec next;
+  void *priv;
+};
+
+extern const struct frame_source_ops source_v4l2;
+extern const struct frame_source_ops source_synth;
+extern const struct frame_source_ops source_replay;
+
+int source_open(struct frame_source *src, struct vdIn *vd, const char *device,
+                int width, int height, int fps, int format);
+int source_grab(struct frame_source *src, struct frame_pool *pool, struct frame **out);
+int source_release(struct frame_source *src);
+void source_close(struct frame_source *src);
+void source_pace(struct frame_source *src);
+
+#endif
@@ -0,0 +1,104 @@
+/*  replay frame source, the MJPEG frames of an AVI file over and over
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <linux/videodev2.h>
+
+#include "v4l2uvc.h"
+#include "source.h"
+#include "avilib.h"
+
+static int replay_open(struct frame_source *src, const char *device)
+{
+  struct vdIn *vd = src->vd;
+  avi_t *avi;
+  char *compressor;
+  long chunk;
+
+  avi = AVI_open_input_file(device, 1);
+  if (avi == NULL) {
+    AVI_print_error("replay");
+    return -1;
+  }
+
+  compressor = AVI_video_compressor(avi);
+  if (AVI_video_frames(avi) <= 0 || compressor == NULL || strncasecmp(compressor, "MJPG", 4)) {
+    fprintf(stderr, "%s: no MJPEG video to replay\n", device);
+    AVI_close(avi);
+    return -1;
+  }
+
+  /* the file decides the size, the rate stays what was asked for */
+  vd->width = AVI_video_width(avi);
+  vd->height = AVI_video_height(avi);
+  vd->formatIn = V4L2_PIX_FMT_MJPEG;
+  vd->framesizeIn = vd->width * vd->height * 2;
+  chunk = AVI_max_video_chunk(avi);
+  if (chunk > vd->framesizeIn) {
+    vd->framesizeIn = chunk;
+  }
+
+  src->priv = avi;
+  return 0;
+}
+
+static int replay_grab(struct frame_source *src, struct frame_pool *pool, struct frame **out)
+{
+  avi_t *avi = (avi_t *)src->priv;
+  struct frame *f;
+  int keyframe;
+  long n;
+
+  *out = NULL;
+  source_pace(src);
+  src->vd->isstreaming = 1;
+
+  f = frame_pool_get(pool);
+  if (f == NULL) {
+    return -1;
+  }
+
+  /* pool frames hold the largest chunk, see replay_open(); start over at the end */
+  n = AVI_read_frame(avi, (char *)f->buff, &keyframe);
+  if (n < 0) {
+    AVI_seek_start(avi);
+    n = AVI_read_frame(avi, (char *)f->buff, &keyframe);
+  }
+  if (n <= 0) {
+    frame_unref(f);
+    return (n < 0) ? -1 : 0;
+  }
+
+  f->size = n;
+  *out = f;
+  return 0;
+}
+
+static int replay_release(struct frame_source *src)
+{
+  src->vd->isstreaming = 0;
+  src->next.tv_sec = 0;
+  return 0;
+}
+
+static void replay_close(struct frame_source *src)
+{
+  if (src->priv) {
+    AVI_close((avi_t *)src->priv);
+    src->priv = NULL;
+  }
+}
+
+const struct frame_source_ops source_replay = {
+  "AVI replay", replay_open, replay_grab, replay_release, replay_close
+};
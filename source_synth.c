@@ -0,0 +1,231 @@
+/*  synthetic frame source, a moving test pattern
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "v4l2uvc.h"
+#include "source.h"
+#include "jpeg_utils.h"
+
+/*
+ * Colour bars with a box moving across them, a different picture for each
+ * of SYNTH_FRAMES steps. All pictures are made in the capture format at
+ * open, grab only copies one into a pool frame like a camera DMA would.
+ */
+#define SYNTH_FRAMES   30
+#define SYNTH_QUALITY  80
+
+struct synth {
+  unsigned char *pics[SYNTH_FRAMES];
+  int sizes[SYNTH_FRAMES];
+  int next;
+};
+
+static const unsigned char bars[8][3] = {
+  {255, 255, 255}, {255, 255, 0}, {0, 255, 255}, {0, 255, 0},
+  {255, 0, 255}, {255, 0, 0}, {0, 0, 255}, {0, 0, 0}
+};
+
+static void synth_draw(unsigned char *rgb, int width, int height, int step)
+{
+  int box = height / 4;
+  int bx = step * (width - box) / (SYNTH_FRAMES - 1);
+  int by = (height - box) / 2;
+  unsigned char *p = rgb;
+  int x, y;
+
+  for (y = 0; y < height; y++) {
+    for (x = 0; x < width; x++, p += 3) {
+      if (x >= bx && x < bx + box && y >= by && y < by + box) {
+        p[0] = p[1] = p[2] = 128;
+      }
+      else if (y >= height * 3 / 4) {
+        /* grey ramp at the bottom */
+        p[0] = p[1] = p[2] = x * 255 / (width - 1);
+      }
+      else {
+        memcpy(p, bars[x * 8 / width], 3);
+      }
+    }
+  }
+}
+
+/* JPEG (JFIF) YCbCr, chroma of a pixel pair averaged */
+static void synth_yuyv(const unsigned char *rgb, unsigned char *yuyv, int pixels)
+{
+  int i, r, g, b, u, v;
+
+  for (i = 0; i < pixels; i += 2, rgb += 6, yuyv += 4) {
+    r = rgb[0] + rgb[3];
+    g = rgb[1] + rgb[4];
+    b = rgb[2] + rgb[5];
+    yuyv[0] = (77 * rgb[0] + 150 * rgb[1] + 29 * rgb[2]) >> 8;
+    yuyv[2] = (77 * rgb[3] + 150 * rgb[4] + 29 * rgb[5]) >> 8;
+    u = 128 + ((-43 * r - 85 * g + 128 * b) >> 9);
+    v = 128 + ((128 * r - 107 * g - 21 * b) >> 9);
+    yuyv[1] = (u < 0) ? 0 : (u > 255) ? 255 : u;
+    yuyv[3] = (v < 0) ? 0 : (v > 255) ? 255 : v;
+  }
+}
+
+static void synth_rggb(const unsigned char *rgb, unsigned char *rggb, int width, int height)
+{
+  int x, y;
+
+  for (y = 0; y < height; y++) {
+    for (x = 0; x < width; x++, rgb += 3) {
+      *rggb++ = (y & 1) ? ((x & 1) ? rgb[2] : rgb[1]) : ((x & 1) ? rgb[1] : rgb[0]);
+    }
+  }
+}
+
+static void synth_close(struct frame_source *src)
+{
+  struct synth *s = (struct synth *)src->priv;
+  int i;
+
+  if (s == NULL) {
+    return;
+  }
+  for (i = 0; i < SYNTH_FRAMES; i++) {
+    free(s->pics[i]);
+  }
+  free(s);
+  src->priv = NULL;
+}
+
+/* the picture of one step in the capture format, JPEG goes through YUYV */
+static int synth_picture(struct synth *s, int step, struct vdIn *vd,
+                         unsigned char *rgb, unsigned char *yuyv, struct jpeg_encoder *enc)
+{
+  int pixels = vd->width * vd->height;
+  struct vdIn view;
+  unsigned char *pic;
+  int size;
+
+  synth_draw(rgb, vd->width, vd->height, step);
+
+  switch (vd->formatIn) {
+  case V4L2_PIX_FMT_RGB24:
+    size = pixels * 3;
+    pic = malloc(size);
+    if (pic) {
+      memcpy(pic, rgb, size);
+    }
+    break;
+  case V4L2_PIX_FMT_SRGGB8:
+    size = pixels;
+    pic = malloc(size);
+    if (pic) {
+      synth_rggb(rgb, pic, vd->width, vd->height);
+    }
+    break;
+  case V4L2_PIX_FMT_YUYV:
+    size = pixels * 2;
+    pic = malloc(size);
+    if (pic) {
+      synth_yuyv(rgb, pic, pixels);
+    }
+    break;
+  default:
+    synth_yuyv(rgb, yuyv, pixels);
+    memset(&view, 0, sizeof(struct vdIn));
+    view.width = vd->width;
+    view.height = vd->height;
+    view.framebuffer = yuyv;
+    pic = malloc(pixels * 2);
+    size = pic ? compress_yuyv_to_jpeg(enc, &view, pic, pixels * 2, SYNTH_QUALITY) : 0;
+    if (size <= 0) {
+      free(pic);
+      return -1;
+    }
+    break;
+  }
+
+  if (pic == NULL) {
+    return -1;
+  }
+  s->pics[step] = pic;
+  s->sizes[step] = size;
+  return 0;
+}
+
+static int synth_open(struct frame_source *src, const char *device)
+{
+  struct vdIn *vd = src->vd;
+  struct jpeg_encoder *enc = NULL;
+  unsigned char *rgb, *yuyv;
+  struct synth *s;
+  int jpeg, i, ret = 0;
+
+  if (vd->width < 2 || vd->height < 2) {
+    return -1;
+  }
+  jpeg = (vd->formatIn == V4L2_PIX_FMT_MJPEG || vd->formatIn == V4L2_PIX_FMT_JPEG);
+  s = (struct synth *)calloc(1, sizeof(struct synth));
+  rgb = malloc(vd->width * vd->height * 3);
+  yuyv = malloc(vd->width * vd->height * 2);
+  if (jpeg) {
+    enc = jpeg_encoder_new();
+  }
+  src->priv = s;
+
+  if (s == NULL || rgb == NULL || yuyv == NULL || (jpeg && enc == NULL)) {
+    ret = -1;
+  }
+  for (i = 0; ret == 0 && i < SYNTH_FRAMES; i++) {
+    ret = synth_picture(s, i, vd, rgb, yuyv, enc);
+  }
+
+  jpeg_encoder_free(enc);
+  free(yuyv);
+  free(rgb);
+  if (ret < 0) {
+    synth_close(src);
+    return -1;
+  }
+  return 0;
+}
+
+static int synth_grab(struct frame_source *src, struct frame_pool *pool, struct frame **out)
+{
+  struct synth *s = (struct synth *)src->priv;
+  struct frame *f;
+
+  *out = NULL;
+  source_pace(src);
+  src->vd->isstreaming = 1;
+
+  f = frame_pool_get(pool);
+  if (f == NULL) {
+    return -1;
+  }
+  f->size = (s->sizes[s->next] > f->capacity) ? f->capacity : s->sizes[s->next];
+  memcpy(f->buff, s->pics[s->next], f->size);
+  s->next = (s->next + 1) % SYNTH_FRAMES;
+
+  *out = f;
+  return 0;
+}
+
+/* nothing to stop, just start the pace over on the next grab */
+static int synth_release(struct frame_source *src)
+{
+  src->vd->isstreaming = 0;
+  src->next.tv_sec = 0;
+  return 0;
+}
+
+const struct frame_source_ops source_synth = {
+  "synthetic", synth_open, synth_grab, synth_release, synth_close
+};
@@ -0,0 +1,120 @@
+/*  bounded single producer / single consumer queue
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spsc.h"
+
+/* size is rounded up to a power of two */
+int spsc_init(struct spsc_queue *q, unsigned int size)
+{
+  unsigned int n = 1;
+
+  while (n < size) {
+    n <<= 1;
+  }
+
+  memset(q, 0, sizeof(struct spsc_queue));
+  q->items = (void **)calloc(n, sizeof(void *));
+  if (q->items == NULL) {
+    return -1;
+  }
+  q->size = n;
+  if (sem_init(&q->avail, 0, 0) < 0) {
+    perror("sem_init");
+    free(q->items);
+    return -1;
+  }
+  return 0;
+}
+
+/* producer side, returns -1 and counts a drop if the queue is full */
+int spsc_push(struct spsc_queue *q, void *item)
+{
+  unsigned int head = q->head;
+  unsigned int depth = head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+  if (depth >= q->size) {
+    __atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  q->items[head & (q->size - 1)] = item;
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&q->pushed, 1, __ATOMIC_RELAXED);
+  if (depth + 1 > q->max_depth) {
+    __atomic_store_n(&q->max_depth, depth + 1, __ATOMIC_RELAXED);
+  }
+
+  sem_post(&q->avail);
+  return 0;
+}
+
+/* consumer side, NULL if the queue is empty */
+void *spsc_trypop(struct spsc_queue *q)
+{
+  unsigned int tail = q->tail;
+  void *item;
+
+  if (tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+
+  item = q->items[tail & (q->size - 1)];
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&q->popped, 1, __ATOMIC_RELAXED);
+  return item;
+}
+
+/* consumer side, waits for an item, NULL once the queue is closed */
+void *spsc_pop(struct spsc_queue *q)
+{
+  void *item;
+
+  for (;;) {
+    if (sem_wait(&q->avail) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("sem_wait");
+      return NULL;
+    }
+    if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+      return NULL;
+    }
+    item = spsc_trypop(q);
+    if (item) {
+      return item;
+    }
+  }
+}
+
+unsigned int spsc_depth(struct spsc_queue *q)
+{
+  return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+/* wake the consumer, it gets NULL from spsc_pop() from now on */
+void spsc_close(struct spsc_queue *q)
+{
+  __atomic_store_n(&q->closed, 1, __ATOMIC_RELEASE);
+  sem_post(&q->avail);
+}
+
+/* items still queued are left to the caller, see spsc_trypop() */
+void spsc_destroy(struct spsc_queue *q)
+{
+  sem_destroy(&q->avail);
+  free(q->items);
+  q->items = NULL;
+}
@@ -0,0 +1,49 @@
+/*  bounded single producer / single consumer queue
+ *
+ *  Copyright (C) 2016 by Borislav Sapundzhiev
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ */
+#ifndef _SPSC_H
+#define _SPSC_H
+
+#include <semaphore.h>
+
+#ifndef CACHELINE
+#define CACHELINE   64
+#endif
+
+/*
+ * Lock free ring of pointers between two threads. The producer never
+ * blocks, a push to a full queue fails and is counted as a drop; the
+ * consumer sleeps on a semaphore while the queue is empty.
+ */
+struct spsc_queue {
+  /* written by the producer only */
+  unsigned int head __attribute__((aligned(CACHELINE)));
+  unsigned long pushed;
+  unsigned long dropped;
+  unsigned int max_depth;
+  /* written by the consumer only */
+  unsigned int tail __attribute__((aligned(CACHELINE)));
+  unsigned long popped;
+  /* read only after init */
+  unsigned int size __attribute__((aligned(CACHELINE)));
+  void **items;
+  int closed;
+  sem_t avail;
+};
+
+int spsc_init(struct spsc_queue *q, unsigned int size);
+int spsc_push(struct spsc_queue *q, void *item);
+void *spsc_pop(struct spsc_queue *q);
+void *spsc_trypop(struct spsc_queue *q);
+unsigned int spsc_depth(struct spsc_queue *q);
+void spsc_close(struct spsc_queue *q);
+void spsc_destroy(struct spsc_queue *q);
+
+#endif
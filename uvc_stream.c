@@ -46,6 +46,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <linux/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
 #include <sys/ioctl.h>
@@ -55,32 +56,58 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <semaphore.h>
 
 #include "v4l2uvc.h"
+#include "source.h"
 #include "jpeg_utils.h"
-#include "cqueue.h"
+#include "pixconv.h"
+#include "jpeg_slice.h"
+#include "frame.h"
+#include "ring.h"
+#include "spsc.h"
+#include "recq.h"
 #include "http.h"
+#include "metrics.h"
 #include "avilib.h"
+#include "filewriter.h"
 
 #define SOURCE_VERSION "1.0.1"
 #define VIDEODEV "/dev/video0"
 #define NELEMS(x) (sizeof(x) / sizeof((x)[0]))
-#define QMAX 3
 #define SERVER_USER "uvc_user"
 
 struct control_data {
   struct vdIn *videoIn;
+  struct frame_source source;
   int width;
   int height;
   int video_dev;
   int quality;
   int fps, daemon;
   int format;
+  int passthrough;
+  int subsamp;
+  int slices;
+  int encode;
+  int idle_off;
   char *filename;
+  /* memory for frames waiting to be written to disk */
+  size_t rec_budget;
+  struct frame_pool pool;
+  struct jpeg_encoder *encoder;
+  struct jpeg_slicer *slicer;
+  /* capture -> encode stage */
+  struct spsc_queue raw_queue;
+  /* published frames -> recorder, it must not miss any */
+  struct rec_queue rec_queue;
   pthread_t tcam;
   pthread_t trecorder;
+  pthread_t tencoder;
 };
 
 struct pixel_format {
@@ -88,12 +115,6 @@ struct pixel_format {
   int format;
 };
 
-struct resolutions{
-  char *name;
-  int width;
-  int height;
-};
-
 struct pixel_format pixel_formats[] = {
     {"MJPG",  V4L2_PIX_FMT_MJPEG  },
     {"JPEG",  V4L2_PIX_FMT_JPEG   },
@@ -102,49 +123,167 @@ struct pixel_format pixel_formats[] = {
     {"RGB24", V4L2_PIX_FMT_RGB24  },
 };
 
-struct resolutions resolutions_formats[] = {
-  /*https://en.wikipedia.org/wiki/Display_resolution#/media/File:Vector_Video_Standards8.svg*/
-  {"1280x720", 1280, 720  },
-  {"960x720",   960, 720  },
-  {"800x600",   800, 600  },
-  {"854x480",   854, 480  },
-  {"800x480",   800, 480  },
-  {"768x576",   768, 576  },
-  {"640x480",   640, 480  },
-  {"480x320",   480, 320  },
-  {"384x288",   384, 288  },
-  {"352x288",   352, 288  },
-  {"320x240",   320, 240  },
-  {"320x200",   320, 200  },
-  {"160x120",   160, 120  },
-};
+/* raw frames waiting for the encoder, keep below NB_BUFFER - MIN_QUEUED */
+#define RAW_QUEUE_MAX 2
+/* default memory for frames waiting to be written to disk, in MB */
+#define REC_BUDGET 64
+/* the recording is written in blocks of this many bytes */
+#define REC_BLOCK (1 << 20)
 
 int stop=0;
 struct control_data cd;
-struct thread_buff tbuff = {
-  PTHREAD_MUTEX_INITIALIZER,
-  PTHREAD_COND_INITIALIZER,
-  {0,0},
-};
+struct frame_ring ring;
+/* frames being encoded, for clients that take the picture as it is made */
+struct frame_ring live_ring;
 
 static void print_version(void);
 static void help(char *progname);
 
-/* the single writer thread */
+/*
+ * Every frame that is published is also copied to the recorder queue, no
+ * frame buffer waits for the disk. A frame the budget has no room for is
+ * counted and reported by the recorder.
+ */
+static void record_frame(struct frame *f)
+{
+  if ( cd.filename ) {
+    recq_push(&cd.rec_queue, f);
+  }
+}
+
+/* a captured frame is dropped, the recorder still has to know about it */
+static void skip_frame(struct frame *f)
+{
+  if ( cd.filename ) {
+    recq_skip(&cd.rec_queue);
+  }
+  frame_unref(f);
+}
+
+/*
+ * Capture stage. Compressed formats are published right here, raw frames
+ * are queued for the encoder thread so the next frame can be captured while
+ * the last one is encoded.
+ */
 static void *cam_thread( void *arg ) {
 
-  struct thread_buff *tbuff = (struct thread_buff*)arg;
-  struct buff * b = NULL;
+  struct frame_ring *ring = (struct frame_ring*)arg;
+  struct frame *f = NULL;
+  time_t busy = time(NULL);
 
   while( !stop ) {
-    /* grab a frame */
-    if( uvcGrab(cd.videoIn) < 0 ) {
+    /* stop the camera after a while without viewers, wait for the next one */
+    if ( ring_viewers(ring) > 0 ) {
+      busy = time(NULL);
+    }
+    else if ( cd.idle_off > 0 && cd.videoIn->isstreaming && time(NULL) - busy >= cd.idle_off ) {
+      fprintf(stderr, "No viewers, camera stream off\n");
+      ring_idle(ring);
+      source_release(&cd.source);
+      ring_wait_viewers(ring);
+      busy = time(NULL);
+      continue;
+    }
+
+    /* the camera hands out its mmap buffers in zero copy mode, see main() */
+    if( source_grab(&cd.source, &cd.pool, &f) < 0 ) {
       fprintf(stderr, "Error grabbing\n");
       exit(1);
     }
+    if ( f == NULL ) {
+      continue;
+    }
+    gettimeofday(&f->timestamp, NULL);
+    f->times.dequeue = frame_clock();
+    metrics_captured();
+    metrics_latency(LATENCY_CAPTURE, f->times.driver, f->times.dequeue);
+    if ( cd.filename ) {
+      recq_number(&cd.rec_queue, f);
+    }
 
-    /* copy frame to global buffer */
-    pthread_mutex_lock( &tbuff->lock );
+    /*
+     * nobody wants the frame, do not even encode it. Compressed frames cost
+     * nothing to publish and keep the latest one fresh for snapshots.
+     */
+    if ( cd.encode && ring_idle(ring) ) {
+      skip_frame(f);
+      f = NULL;
+    }
+    else if ( cd.encode ) {
+      /* the encoder is behind, drop this frame and give the buffer back */
+      if ( spsc_push(&cd.raw_queue, f) < 0 ) {
+        skip_frame(f);
+      }
+      f = NULL;
+    }
+
+    /* publish frame to the clients, the oldest one is released */
+    if ( f != NULL ) {
+      http_frame_part(f);
+      f->times.publish = frame_clock();
+      metrics_latency(LATENCY_PUBLISH, f->times.dequeue, f->times.publish);
+      record_frame(f);
+      ring_publish(ring, f);
+    }
+  }
+  printf("Exit cam thread\n");
+  if ( cd.encode ) {
+    spsc_close(&cd.raw_queue);
+  }
+  pthread_exit(NULL);
+}
+
+/* the encoder made more of a live frame final */
+static void live_output(void *arg, int bytes)
+{
+  struct frame *f = (struct frame *)arg;
+
+  __atomic_store_n(&f->ready, bytes, __ATOMIC_RELEASE);
+  ring_progress(&live_ring);
+}
+
+/*
+ * Encode stage, takes the raw frames queued by cam_thread, compresses and
+ * publishes them. While there are live viewers a frame is published to the
+ * live ring before it is encoded, they get the data as libjpeg writes it.
+ */
+static void *encoder_thread( void *arg ) {
+
+  struct frame_ring *ring = (struct frame_ring*)arg;
+  struct frame *raw, *f;
+  struct vdIn view;
+  int live;
+
+  /* the compressors only look at the picture size, format and data */
+  memset(&view, 0, sizeof(struct vdIn));
+  view.width = cd.videoIn->width;
+  view.height = cd.videoIn->height;
+  view.formatIn = cd.videoIn->formatIn;
+
+  while( (raw = spsc_pop(&cd.raw_queue)) != NULL ) {
+    f = frame_pool_get(&cd.pool);
+    if ( f == NULL ) {
+      fprintf(stderr, "Error allocating frame\n");
+      exit(1);
+    }
+    view.framebuffer = raw->buff;
+    f->timestamp = raw->timestamp;
+    f->times = raw->times;
+    f->seq = raw->seq;
+    f->times.encode_start = frame_clock();
+
+    /* the slicer joins the stripes at the end, its frames come in one piece */
+    live = ring_viewers(&live_ring) > 0;
+    if ( live ) {
+      f->ready = 0;
+      f->done = 0;
+      if ( cd.slicer == NULL ) {
+        jpeg_encoder_output(cd.encoder, live_output, f);
+      }
+      /* the first publish counts, live frames are published before they are encoded */
+      f->times.publish = f->times.encode_start;
+      ring_publish(&live_ring, frame_ref(f));
+    }
 
    /*
     * If capturing in YUV mode convert to JPEG now.
@@ -152,45 +291,80 @@ static void *cam_thread( void *arg ) {
     * Getting JPEGs straight from the webcam, is one of the major advantages of
     * Linux-UVC compatible devices.
     */
-    b = queue_pop(&(tbuff)->qbuff);
+    if(cd.slicer != NULL) {
 
-    if(cd.videoIn->formatIn == V4L2_PIX_FMT_YUYV) {
-
-      b->size = compress_yuyv_to_jpeg(cd.videoIn, b->buff, cd.videoIn->framesizeIn, cd.quality);
+      f->size = jpeg_slicer_compress(cd.slicer, &view, f->buff, f->capacity, cd.quality);
     }
-    else if(cd.videoIn->formatIn == V4L2_PIX_FMT_SRGGB8) {
+    else if(view.formatIn == V4L2_PIX_FMT_YUYV) {
 
-      b->size = compress_rggb_to_jpeg(cd.videoIn, b->buff, cd.videoIn->framesizeIn, cd.quality);
+      f->size = compress_yuyv_to_jpeg(cd.encoder, &view, f->buff, f->capacity, cd.quality);
     }
-    else if(cd.videoIn->formatIn == V4L2_PIX_FMT_RGB24) {
+    else if(view.formatIn == V4L2_PIX_FMT_SRGGB8) {
 
-      b->size = compress_rgb_to_jpeg(cd.videoIn, b->buff, cd.videoIn->framesizeIn, cd.quality);
+      f->size = compress_rggb_to_jpeg(cd.encoder, &view, f->buff, f->capacity, cd.quality);
     }
     else {
-      b->size = cd.videoIn->framesizeIn;
-      memcpy(b->buff, cd.videoIn->tmpbuffer, cd.videoIn->framesizeIn);
+
+      f->size = compress_rgb_to_jpeg(cd.encoder, &view, f->buff, f->capacity, cd.quality);
+    }
+
+    if ( live ) {
+      jpeg_encoder_output(cd.encoder, NULL, NULL);
+      if ( f->size > 0 ) {
+        __atomic_store_n(&f->ready, f->size, __ATOMIC_RELEASE);
+      }
+      __atomic_store_n(&f->done, 1, __ATOMIC_RELEASE);
+      ring_progress(&live_ring);
     }
 
-    queue_push(&(tbuff)->qbuff, b);
-    /* signal fresh_frame */
-    pthread_cond_broadcast(&tbuff->cond);
-    pthread_mutex_unlock(&tbuff->lock);
+    /* the raw buffer goes back to the driver before the frame is published */
+    frame_unref(raw);
+    f->times.encode_end = frame_clock();
+    metrics_encoded(&f->times, f->size > 0);
+
+    if ( f->size <= 0 ) {
+      skip_frame(f);
+      continue;
+    }
 
-    /* only use usleep if the fps is below 5, otherwise the overhead is too long */
-    if ( cd.videoIn->fps < 5 ) {
-      usleep(1000*1000/cd.videoIn->fps);
+    http_frame_part(f);
+    if ( !live ) {
+      f->times.publish = frame_clock();
+      metrics_latency(LATENCY_PUBLISH, f->times.encode_end, f->times.publish);
     }
+    record_frame(f);
+    ring_publish(ring, f);
   }
-  printf("Exit cam thread\n");
+  printf("Exit encoder thread\n");
   pthread_exit(NULL);
 }
 
+static void print_stats(void)
+{
+  if ( !cd.encode ) {
+    return;
+  }
+  fprintf(stderr, "capture: %lu queued, %lu dropped, queue %u (max %u)\n",
+          cd.raw_queue.pushed, cd.raw_queue.dropped,
+          spsc_depth(&cd.raw_queue), cd.raw_queue.max_depth);
+  fprintf(stderr, "encode: %lu frames, %lu failed\n", metrics.encoded, metrics.encode_errors);
+}
+
+/*
+ * Recorder, one more consumer of the published frames. It has a queue of
+ * its own instead of the ring, a slow disk must not make it skip frames.
+ * Frames the queue had to drop show up as gaps in the sequence numbers,
+ * they are reported and the previous frame is repeated in their place so
+ * the recording keeps its timing.
+ */
 static void *video_recoreder_thread(void *arg)
 {
   struct vdIn *vd = cd.videoIn;
 
-  struct thread_buff *tbuff = (struct thread_buff*)arg;
-  struct buff * b = NULL;
+  struct frame_ring *ring = (struct frame_ring*)arg;
+  struct rec_entry *e;
+  unsigned int next = 0, last;
+  int failed = 0;
 
   avi_t *avifile = AVI_open_output_file(cd.filename);
 
@@ -199,41 +373,120 @@ static void *video_recoreder_thread(void *arg)
     exit(-1);
   }
 
+  /* AVI 2.0, long recordings go on past the 4 GB of a plain AVI */
+  if ( AVI_set_opendml(avifile) < 0 ) {
+    AVI_print_error("recorder, no OpenDML");
+  }
   AVI_set_video(avifile, vd->width, vd->height, vd->fps, "MJPG");
+
+  /* no small writes on the SD card, they stall the recorder */
+  if ( AVI_set_writer(avifile, REC_BLOCK, FW_PREALLOC | FW_DROP_CACHE) < 0 ) {
+    AVI_print_error("recorder, writing unbuffered");
+  }
   printf("recording to %s\n", cd.filename);
 
-  while(!stop) {
+  /* the queue is closed at shutdown, what is still in it gets written too */
+  while( (e = recq_peek(&cd.rec_queue)) != NULL ) {
 
-    pthread_mutex_lock(&(tbuff)->lock);
-    pthread_cond_wait(&(tbuff)->cond, &(tbuff)->lock);
+    if ( e->seq != next ) {
+      fprintf(stderr, "recorder: frames %u-%u dropped\n", next, e->seq - 1);
+      for ( ; next != e->seq && !failed; next++ ) {
+        failed = AVI_dup_frame(avifile) < 0;
+      }
+    }
 
-    b = queue_front(&(tbuff)->qbuff);
-    AVI_write_frame(avifile, (char*)b->buff, b->size, vd->framecount);
+    /* every MJPEG frame is a key frame */
+    if ( !failed && AVI_write_frame(avifile, (char *)(e + 1), e->size, 1) < 0 ) {
+      AVI_print_error("recorder");
+      failed = 1;
+    }
     vd->framecount++;
+    next = e->seq + 1;
 
-    pthread_mutex_unlock(&(tbuff)->lock);
+    recq_pop(&cd.rec_queue, e);
   }
+  /* main made the recorder a viewer */
+  ring_viewers_add(ring, -1);
+
+  /* the capture thread is gone, every frame it numbered is accounted for */
+  last = __atomic_load_n(&cd.rec_queue.seq, __ATOMIC_ACQUIRE);
+  if ( last != next ) {
+    fprintf(stderr, "recorder: frames %u-%u dropped at the end\n", next, last - 1);
+    for ( ; next != last && !failed; next++ ) {
+      failed = AVI_dup_frame(avifile) < 0;
+    }
+  }
+  fprintf(stderr, "recorder: %lu frames written, %lu dropped over the budget, "
+          "%lu before publishing, %lu of %lu KB used at most\n",
+          cd.rec_queue.written, cd.rec_queue.dropped, cd.rec_queue.skipped,
+          cd.rec_queue.max_used >> 10, (unsigned long)(cd.rec_queue.size >> 10));
   printf("exit vr thread\n");
   AVI_close(avifile);
   pthread_exit(NULL);
 }
 
+/* posted by SIGUSR1, the report is printed outside the handler */
+static sem_t latency_request;
+
+static void *latency_thread(void *arg) {
+  char report[LATENCY_REPORT];
+  int n;
+
+  for (;;) {
+    if ( sem_wait(&latency_request) < 0 ) {
+      continue;
+    }
+    n = metrics_latency_print(report, sizeof(report));
+    if ( write(STDERR_FILENO, report, n) < 0 ) {
+      perror("write");
+    }
+  }
+  return NULL;
+}
+
+/* SIGUSR1 prints the latency histograms, sem_post() is async-signal-safe */
+static void latency_handler(int sig) {
+  int saved = errno;
+
+  sem_post(&latency_request);
+  errno = saved;
+}
+
 static void signal_handler(int sigm) {
   /* signal "stop" to threads */
   stop = 1;
   /* cleanup most important structures */
   fprintf(stderr, "Shutdown...\n");
-  pthread_cond_broadcast(&tbuff.cond);
+  ring_stop(&ring);
+  ring_stop(&live_ring);
   pthread_join(server.client, NULL);
   usleep(1000 * 1000);
   pthread_join(cd.tcam, NULL);
-  close_v4l2(cd.videoIn);
+  if ( cd.encode ) {
+    struct frame *raw;
+
+    spsc_close(&cd.raw_queue);
+    pthread_join(cd.tencoder, NULL);
+    while ( (raw = spsc_trypop(&cd.raw_queue)) != NULL ) {
+      skip_frame(raw);
+    }
+    print_stats();
+    spsc_destroy(&cd.raw_queue);
+  }
+  if ( cd.filename ) {
+    recq_close(&cd.rec_queue);
+    pthread_join(cd.trecorder, NULL);
+    recq_destroy(&cd.rec_queue);
+  }
+  ring_destroy(&ring);
+  ring_destroy(&live_ring);
+  jpeg_encoder_free(cd.encoder);
+  jpeg_slicer_free(cd.slicer);
+  source_close(&cd.source);
   free(cd.videoIn);
   if (close (server.sd) < 0) {
 	  perror ("close sd");
   }
-  pthread_cond_destroy(&tbuff.cond);
-  pthread_mutex_destroy(&tbuff.lock);
   exit(0);
 }
 
@@ -273,13 +526,16 @@ int main(int argc, char *argv[])
   char *dev = VIDEODEV;
   char *fmtStr = "UNKNOWN";
   int i;
+  pthread_t tlatency;
   cd.format = V4L2_PIX_FMT_MJPEG;
   cd.fps= 5;
   cd.daemon = 0;
+  cd.passthrough = 0;
   cd.width=640;
   cd.height=480;
   server.port = htons(8080);
   cd.quality = 40;
+  cd.rec_budget = (size_t)REC_BUDGET << 20;
   server.username = SERVER_USER;
 
   while(1) {
@@ -306,6 +562,14 @@ int main(int argc, char *argv[])
       {"b", no_argument, 0, 0},
       {"background", no_argument, 0, 0},
       {"o", required_argument, 0, 0},
+      {"z", no_argument, 0, 0},
+      {"e", required_argument, 0, 0},
+      {"s", required_argument, 0, 0},
+      {"j", required_argument, 0, 0},
+      {"i", required_argument, 0, 0},
+      {"F", required_argument, 0, 0},
+      {"c", required_argument, 0, 0},
+      {"M", required_argument, 0, 0},
       {0, 0, 0, 0}
     };
 
@@ -334,7 +598,7 @@ int main(int argc, char *argv[])
       /* r, resolution */
       case 4:
       case 5:
-          for(i = 0; i < NELEMS(resolutions_formats); i++){
+          for(i = 0; i < NB_RESOLUTIONS; i++){
             if(!strcmp(resolutions_formats[i].name, optarg)) {
                 cd.width = resolutions_formats[i].width;
                 cd.height = resolutions_formats[i].height;
@@ -386,6 +650,42 @@ int main(int argc, char *argv[])
       case 19:
         cd.filename = optarg;
         break;
+      /* z */
+      case 20:
+        cd.passthrough = 1;
+        break;
+      /* e */
+      case 21:
+        server.event_threads = atoi(optarg);
+        break;
+      /* s */
+      case 22:
+        cd.subsamp = (atoi(optarg) == 422) ? JPEG_SUBSAMP_422 : JPEG_SUBSAMP_420;
+        break;
+      /* j */
+      case 23:
+        cd.slices = atoi(optarg);
+        break;
+      /* i */
+      case 24:
+        cd.idle_off = atoi(optarg);
+        break;
+      /* F */
+      case 25:
+        for(i = 0; i < NELEMS(pixel_formats); i++){
+          if(!strcasecmp(pixel_formats[i].name, optarg)) {
+            cd.format = pixel_formats[i].format;
+          }
+        }
+        break;
+      /* c */
+      case 26:
+        server.max_fps = atof(optarg);
+        break;
+      /* M */
+      case 27:
+        cd.rec_budget = (size_t)atoi(optarg) << 20;
+        break;
       default:
         help(argv[0]);
         return 0;
@@ -398,6 +698,10 @@ int main(int argc, char *argv[])
     fprintf(stderr, "could not register signal handler\n");
     exit(1);
   }
+  sem_init(&latency_request, 0, 0);
+  pthread_create(&tlatency, NULL, latency_thread, NULL);
+  pthread_detach(tlatency);
+  signal(SIGUSR1, latency_handler);
 
   /* allocate webcam datastructure */
   cd.videoIn = (struct vdIn *) calloc(1, sizeof(struct vdIn));
@@ -408,44 +712,98 @@ int main(int argc, char *argv[])
     }
   }
 
-  fprintf(stderr, "Using V4L2 device: %s\n", dev);
+  fprintf(stderr, "Using device: %s\n", dev);
   fprintf(stderr, "Format: %s\n", fmtStr);
   fprintf(stderr, "JPEG quality: %i\n", cd.quality);
   fprintf(stderr, "Resolution: %i x %i @ %i fps\n", cd.width, cd.height, cd.fps);
   fprintf(stderr, "TCP port: %i user: %s pass: %s\n", ntohs(server.port),
                   server.username, server.password ? "*****" : "none !!!");
   /* open video device and prepare data structure */
-  cd.video_dev = init_videoIn(cd.videoIn, dev, cd.width, cd.height, cd.fps, cd.format, 1);
+  cd.video_dev = source_open(&cd.source, cd.videoIn, dev, cd.width, cd.height, cd.fps, cd.format);
   if (cd.video_dev < 0) {
     fprintf(stderr, "init_VideoIn failed\n");
     exit(1);
   }
+  /* a replayed file brings its own size and format */
+  cd.format = cd.videoIn->formatIn;
+  fprintf(stderr, "Source: %s, %i x %i\n", cd.source.ops->name, cd.videoIn->width, cd.videoIn->height);
 
   /* fork to the background */
   if ( cd.daemon ) {
     daemon_mode();
   }
 
+  /* passthrough only makes sense if the camera delivers JPEG already */
+  if ( cd.passthrough && cd.format != V4L2_PIX_FMT_MJPEG && cd.format != V4L2_PIX_FMT_JPEG ) {
+    fprintf(stderr, "Passthrough requires MJPEG format, disabled\n");
+    cd.passthrough = 0;
+  }
+
   /* start to read the camera, push picture buffers into global buffer */
-  init_queue(&tbuff.qbuff, QMAX);
-  for(i=0; i  < QMAX; i++){
-    struct buff *b = malloc(sizeof(b));
-    b->buff =(unsigned char *) calloc(1, (size_t)cd.videoIn->framesizeIn);
-    queue_push(&tbuff.qbuff, b);
+  ring_init(&ring);
+  ring_init(&live_ring);
+  cd.encode = (cd.format != V4L2_PIX_FMT_MJPEG && cd.format != V4L2_PIX_FMT_JPEG);
+  /* the mmap buffer itself goes to the next stage, no copy at all */
+  cd.source.zero_copy = cd.passthrough || cd.encode;
+  metrics.vd = cd.videoIn;
+  if (cd.format == V4L2_PIX_FMT_RGB24) {
+    /* pool frames also carry raw pictures */
+    frame_pool_init(&cd.pool, cd.videoIn->width * cd.videoIn->height * 3);
+  } else {
+    frame_pool_init(&cd.pool, cd.videoIn->framesizeIn);
+  }
+  cd.encoder = jpeg_encoder_new();
+  if (cd.encoder == NULL) {
+    fprintf(stderr, "could not allocate the jpeg encoder\n");
+    exit(1);
+  }
+  jpeg_encoder_subsampling(cd.encoder, cd.subsamp);
+  fprintf(stderr, "Pixel conversion: %s\n", pixconv.name);
+  /* compressed formats are passed on as they are */
+  if (cd.slices > 1 && cd.encode) {
+    cd.slicer = jpeg_slicer_new(cd.slices, cd.subsamp);
+    if (cd.slicer == NULL) {
+      fprintf(stderr, "could not start the slice encoder\n");
+      exit(1);
+    }
+    fprintf(stderr, "Encoder threads: %d\n", cd.slices);
   }
 
-  pthread_create(&cd.tcam, NULL, cam_thread, &tbuff);
-  pthread_detach(cd.tcam);
+  /*
+   * recording and streaming share the capture and the encoder. The camera
+   * keeps running for the recorder as for any viewer, from the first frame
+   * on; the recorder takes its viewer back when it exits.
+   */
+  if (cd.filename) {
+    if (recq_init(&cd.rec_queue, cd.rec_budget) < 0) {
+      fprintf(stderr, "could not allocate the recorder queue\n");
+      exit(1);
+    }
+    metrics.recq = &cd.rec_queue;
+    ring_viewers_add(&ring, 1);
+    pthread_create(&cd.trecorder, NULL, video_recoreder_thread, &ring);
+  }
 
-  if(cd.filename) {
-    pthread_create(&cd.trecorder, NULL, video_recoreder_thread, &tbuff);
-    pthread_join(cd.trecorder, NULL);
-  } else {
-    /*start http streamer */
-    server.ptbuff = &tbuff;
-    http_listener(&server);
+  if (cd.encode) {
+    if (spsc_init(&cd.raw_queue, RAW_QUEUE_MAX) < 0) {
+      fprintf(stderr, "could not allocate the encoder queue\n");
+      exit(1);
+    }
+    metrics.queue = &cd.raw_queue;
+    pthread_create(&cd.tencoder, NULL, encoder_thread, &ring);
   }
 
+  pthread_create(&cd.tcam, NULL, cam_thread, &ring);
+  pthread_detach(cd.tcam);
+
+  /*start http streamer */
+  server.ring = &ring;
+  /* only pictures encoded here can be streamed while they are made */
+  server.live = cd.encode ? &live_ring : NULL;
+  metrics.ring = &ring;
+  metrics.live = server.live;
+  http_listener(&server);
+
   return 0;
 }
 
@@ -464,7 +822,19 @@ void help(char *progname)
     " [-q ]                  compression quality\n"
     " [-v | --version ]      display version information\n"
     " [-b | --background]    fork to the background, daemon mode\n"
-    " [-o ]                  output filename (.avi)\n"
+    " [-o ]                  record to this file (.avi) while streaming\n"
+    " [-M ]                  MB of memory for frames waiting to be recorded (64)\n"
+    " [-z ]                  zero-copy MJPEG passthrough\n"
+    " [-e ]                  event driven server with N epoll threads\n"
+    " [-s ]                  YUYV chroma subsampling, 420 (default) or 422\n"
+    " [-j ]                  encode YUYV/RGB frames in N parallel slices\n"
+    " [-i ]                  stop the camera after N seconds without viewers\n"
+    " [-F ]                  pixel format by name: MJPG, JPEG, YUYV, RGGB, RGB24\n"
+    " [-c ]                  send streams at most N fps, clients may ask for less\n"
+    "                        with /stream.mjpeg?fps=N\n"
+    "\n"
+    " -d synth               synthetic test pattern at -r, -f and the format\n"
+    " -d file.avi            replay the MJPEG frames of a recording at -f fps\n"
     "\n", progname);
 }
 
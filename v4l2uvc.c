@@ -27,9 +27,30 @@
 #include "v4l2uvc.h"
 
 
+#define HEADERFRAME1 0xaf
+
 static int debug = 0;
 
+struct resolutions resolutions_formats[NB_RESOLUTIONS] = {
+  /*https://en.wikipedia.org/wiki/Display_resolution#/media/File:Vector_Video_Standards8.svg*/
+  {"1280x720", 1280, 720  },
+  {"960x720",   960, 720  },
+  {"800x600",   800, 600  },
+  {"854x480",   854, 480  },
+  {"800x480",   800, 480  },
+  {"768x576",   768, 576  },
+  {"640x480",   640, 480  },
+  {"480x320",   480, 320  },
+  {"384x288",   384, 288  },
+  {"352x288",   352, 288  },
+  {"320x240",   320, 240  },
+  {"320x200",   320, 200  },
+  {"160x120",   160, 120  },
+};
+
+
 static int init_v4l2(struct vdIn *vd);
+static void uvcReleaseFrame(struct frame *f);
 
 int
 init_videoIn(struct vdIn *vd, char *device, int width, int height, int fps,
@@ -213,10 +234,17 @@ static int init_v4l2(struct vdIn *vd)
     }
     if (debug)
       printf("Buffer mapped at address %p.\n", vd->mem[i]);
+
+    vd->frames[i].buff = vd->mem[i];
+    vd->frames[i].capacity = vd->buf.length;
+    vd->frames[i].index = i;
+    vd->frames[i].priv = vd;
+    vd->frames[i].release = uvcReleaseFrame;
   }
   /*
    * Queue the buffers.
    */
+  pthread_mutex_init(&vd->qlock, NULL);
   for (i = 0; i < NB_BUFFER; ++i) {
     memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
     vd->buf.index = i;
@@ -227,7 +255,9 @@ static int init_v4l2(struct vdIn *vd)
       printf("Unable to queue buffer (%d).\n", errno);
       goto fatal;;
     }
+    vd->inqueue[i] = 1;
   }
+  vd->queued = NB_BUFFER;
   return 0;
 fatal:
   return -1;
@@ -266,7 +296,6 @@ static int video_disable(struct vdIn *vd)
 
 int uvcGrab(struct vdIn *vd)
 {
-#define HEADERFRAME1 0xaf
   int ret;
 
   if (!vd->isstreaming) {
@@ -283,8 +312,10 @@ int uvcGrab(struct vdIn *vd)
   ret = ioctl(vd->fd, VIDIOC_DQBUF, &vd->buf);
   if (ret < 0) {
     printf("Unable to dequeue buffer (%d).\n", errno);
+    __atomic_add_fetch(&vd->dqbuf_errors, 1, __ATOMIC_RELAXED);
     goto err;
   }
+  vd->inqueue[vd->buf.index] = 0;
 
   switch (vd->formatIn) {
     case V4L2_PIX_FMT_JPEG:
@@ -292,6 +323,7 @@ int uvcGrab(struct vdIn *vd)
         if (vd->buf.bytesused <= HEADERFRAME1) {
             /* Prevent crash on empty image */
             printf("Ignoring empty buffer ...\n");
+            __atomic_add_fetch(&vd->empty_buffers, 1, __ATOMIC_RELAXED);
             return 0;
         }
 
@@ -319,7 +351,132 @@ int uvcGrab(struct vdIn *vd)
     printf("Unable to requeue buffer (%d).\n", errno);
     goto err;
   }
+  vd->inqueue[vd->buf.index] = 1;
+
+  return 0;
+
+err:
+  vd->signalquit = 0;
+  return -1;
+}
+
+static int queue_buffer(struct vdIn *vd, int index)
+{
+  struct v4l2_buffer buf;
+  int ret;
+
+  memset(&buf, 0, sizeof(struct v4l2_buffer));
+  buf.index = index;
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf.memory = V4L2_MEMORY_MMAP;
+
+  ret = ioctl(vd->fd, VIDIOC_QBUF, &buf);
+  if (ret < 0) {
+    printf("Unable to requeue buffer (%d).\n", errno);
+  }
+  return ret;
+}
+
+/* give a dequeued buffer back to the driver */
+static int requeue_buffer(struct vdIn *vd, int index)
+{
+  int ret;
+
+  pthread_mutex_lock(&vd->qlock);
+  ret = queue_buffer(vd, index);
+  if (ret == 0) {
+    vd->inqueue[index] = 1;
+  }
+  pthread_mutex_unlock(&vd->qlock);
+  if (ret < 0) {
+    return ret;
+  }
+  __atomic_add_fetch(&vd->queued, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* capture time of a dequeued buffer on the frame_clock(), 0 if the driver has another clock */
+uint64_t uvcBufferTime(struct v4l2_buffer *buf)
+{
+  if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+    return 0;
+  }
+  return (uint64_t)buf->timestamp.tv_sec * 1000000000ULL + (uint64_t)buf->timestamp.tv_usec * 1000ULL;
+}
+
+/* called when the last consumer drops a passthrough frame */
+static void uvcReleaseFrame(struct frame *f)
+{
+  requeue_buffer((struct vdIn *)f->priv, f->index);
+}
+
+/*
+ * Dequeue a MJPEG frame without copying it. The returned frame points into
+ * the mmap buffer and goes back to the driver when its last reference is
+ * dropped. If consumers hold on to so many buffers that fewer than
+ * MIN_QUEUED would stay queued, the picture is copied to a frame from "pool"
+ * instead so capture never stalls. *out is NULL for empty buffers.
+ */
+int uvcGrabFrame(struct vdIn *vd, struct frame_pool *pool, struct frame **out)
+{
+  struct v4l2_buffer buf;
+  struct frame *f;
+  int ret, queued;
+
+  *out = NULL;
+
+  if (!vd->isstreaming) {
+    if (video_enable(vd)){
+      goto err;
+    }
+  }
+
+  memset(&buf, 0, sizeof(struct v4l2_buffer));
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf.memory = V4L2_MEMORY_MMAP;
+
+  ret = ioctl(vd->fd, VIDIOC_DQBUF, &buf);
+  if (ret < 0) {
+    printf("Unable to dequeue buffer (%d).\n", errno);
+    __atomic_add_fetch(&vd->dqbuf_errors, 1, __ATOMIC_RELAXED);
+    goto err;
+  }
+  queued = __atomic_sub_fetch(&vd->queued, 1, __ATOMIC_ACQUIRE);
+  vd->inqueue[buf.index] = 0;
+
+  if (buf.bytesused <= HEADERFRAME1) {
+    /* Prevent crash on empty image */
+    printf("Ignoring empty buffer ...\n");
+    __atomic_add_fetch(&vd->empty_buffers, 1, __ATOMIC_RELAXED);
+    if (requeue_buffer(vd, buf.index) < 0) {
+      goto err;
+    }
+    return 0;
+  }
+
+  if (queued < MIN_QUEUED) {
+    f = frame_pool_get(pool);
+    if (f == NULL) {
+      requeue_buffer(vd, buf.index);
+      goto err;
+    }
+    f->size = (buf.bytesused > f->capacity) ? f->capacity : buf.bytesused;
+    f->times.driver = uvcBufferTime(&buf);
+    memcpy(f->buff, vd->mem[buf.index], (size_t) f->size);
+    if (requeue_buffer(vd, buf.index) < 0) {
+      frame_unref(f);
+      goto err;
+    }
+    *out = f;
+    return 0;
+  }
 
+  f = &vd->frames[buf.index];
+  f->size = buf.bytesused;
+  memset(&f->times, 0, sizeof(struct frame_times));
+  f->times.driver = uvcBufferTime(&buf);
+  __atomic_store_n(&f->refcount, 1, __ATOMIC_RELEASE);
+  *out = f;
   return 0;
 
 err:
@@ -327,6 +484,31 @@ err:
   return -1;
 }
 
+/*
+ * Stop streaming while nobody watches, the next grab starts it again.
+ * STREAMOFF takes all buffers away from the driver, the ones it had are
+ * queued again right away. Buffers held by frames are queued as usual
+ * when they are released.
+ */
+int uvcStreamOff(struct vdIn *vd)
+{
+  int i, ret = 0;
+
+  if (!vd->isstreaming) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&vd->qlock);
+  ret = video_disable(vd);
+  for (i = 0; ret == 0 && i < NB_BUFFER; i++) {
+    if (vd->inqueue[i]) {
+      ret = queue_buffer(vd, i);
+    }
+  }
+  pthread_mutex_unlock(&vd->qlock);
+  return ret;
+}
+
 int close_v4l2(struct vdIn *vd)
 {
   if (vd->isstreaming)
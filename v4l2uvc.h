@@ -31,11 +31,24 @@
 #include <sys/select.h>
 #include <linux/videodev2.h>
 
+#include "frame.h"
 
-#define NB_BUFFER 4
+#define NB_BUFFER 6
+/* buffers kept with the driver before passthrough frames fall back to a copy */
+#define MIN_QUEUED 2
 #define DHT_SIZE 432
 #define V4L2_CID_PANTILT_RESET          (V4L2_CID_PRIVATE_BASE+9)
 
+/* picture sizes known by name, e.g. "-r 640x480" */
+struct resolutions {
+    char *name;
+    int width;
+    int height;
+};
+
+#define NB_RESOLUTIONS 13
+extern struct resolutions resolutions_formats[NB_RESOLUTIONS];
+
 struct vdIn {
     int fd;
     char *videodevice;
@@ -70,6 +83,15 @@ struct vdIn {
     int framecount;
     int recordstart;
     int recordtime;
+    /* mjpeg passthrough, frames point straight into the mmap buffers */
+    int queued;
+    struct frame frames[NB_BUFFER];
+    /* which buffers the driver has, guarded by qlock against uvcStreamOff() */
+    char inqueue[NB_BUFFER];
+    pthread_mutex_t qlock;
+    /* capture counters, read by the metrics */
+    unsigned long dqbuf_errors;
+    unsigned long empty_buffers;
 };
 
 int init_videoIn(struct vdIn *vd, char *device, int width, int height, int fps, int format, int grabmethod);
@@ -78,6 +100,9 @@ int save_controls(int vd);
 int load_controls(int vd);
 
 int uvcGrab(struct vdIn *vd);
+int uvcGrabFrame(struct vdIn *vd, struct frame_pool *pool, struct frame **out);
+uint64_t uvcBufferTime(struct v4l2_buffer *buf);
+int uvcStreamOff(struct vdIn *vd);
 int close_v4l2(struct vdIn *vd);
 
 int v4l2GetControl(struct vdIn *vd, int control);